@@ -0,0 +1,80 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_ALIAS_SAMPLER_H
+#define SRC_ALIAS_SAMPLER_H
+
+#include <cstdint>
+#include <vector>
+
+//Walker's alias method, O(1) draws from a fixed discrete distribution.
+//the table is read only once built and can be shared by all threads
+class AliasSampler {
+public:
+	AliasSampler() {}
+
+	bool Build(const std::vector<double>& weights) {
+		size_t n = weights.size();
+		double total = 0.;
+		for (size_t i = 0; i < n; ++i) total += weights[i];
+		if (n == 0 || total <= 0.) return false;
+
+		prob_.assign(n, 0.f);
+		alias_.assign(n, 0);
+		std::vector<double> scaled(n);
+		std::vector<uint32_t> small, large;
+		for (size_t i = 0; i < n; ++i) {
+			scaled[i] = weights[i] * n / total;
+			if (scaled[i] < 1.) small.push_back(i);
+			else large.push_back(i);
+		}
+		while (!small.empty() && !large.empty()) {
+			uint32_t s = small.back(), l = large.back();
+			small.pop_back();
+			prob_[s] = static_cast<float>(scaled[s]);
+			alias_[s] = l;
+			scaled[l] -= 1. - scaled[s];
+			if (scaled[l] < 1.) {
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+		for (size_t i = 0; i < large.size(); ++i) prob_[large[i]] = 1.f;
+		for (size_t i = 0; i < small.size(); ++i) prob_[small[i]] = 1.f;
+		return true;
+	}
+
+	//rand is a uniformly distributed 64 bit value
+	uint32_t Sample(uint64_t rand) const {
+		uint32_t i = static_cast<uint32_t>((rand >> 32) * prob_.size() >> 32);
+		//24 bits fit a float exactly, so the coin stays below 1 and prob_ 1 never takes the alias
+		float coin = static_cast<float>(rand & 0xffffffULL) * (1.f / 16777216.f);
+		return coin < prob_[i] ? i : alias_[i];
+	}
+
+	size_t size() const { return prob_.size(); }
+
+private:
+	std::vector<float> prob_;
+	std::vector<uint32_t> alias_;
+};
+
+#endif // SRC_ALIAS_SAMPLER_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
@@ -0,0 +1,227 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_ALS_MF_SOLVER_H
+#define SRC_ALS_MF_SOLVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+#include "src/mf_solver.h"
+#include "src/rating_matrix.h"
+#include "src/stopwatch.h"
+#include "src/util.h"
+
+//solve a x = b in place for symmetric positive definite a (n x n, row major),
+//the solution overwrites b, returns false if a is not positive definite
+inline bool cholesky_solve(double* a, double* b, int n) {
+	for (int j = 0; j < n; ++j) {
+		double d = a[j * n + j];
+		for (int k = 0; k < j; ++k)
+			d -= a[j * n + k] * a[j * n + k];
+		if (d <= 0.) return false;
+		d = std::sqrt(d);
+		a[j * n + j] = d;
+		for (int i = j + 1; i < n; ++i) {
+			double s = a[i * n + j];
+			for (int k = 0; k < j; ++k)
+				s -= a[i * n + k] * a[j * n + k];
+			a[i * n + j] = s / d;
+		}
+	}
+	for (int i = 0; i < n; ++i) {
+		double s = b[i];
+		for (int k = 0; k < i; ++k)
+			s -= a[i * n + k] * b[k];
+		b[i] = s / a[i * n + i];
+	}
+	for (int i = n - 1; i >= 0; --i) {
+		double s = b[i];
+		for (int k = i + 1; k < n; ++k)
+			s -= a[k * n + i] * b[k];
+		b[i] = s / a[i * n + i];
+	}
+	return true;
+}
+
+//alternating least squares, each row solves its own dim x dim normal equations.
+//in implicit mode (iALS) every unobserved pair is a zero with confidence 1 and an
+//observed score s is a one with confidence 1 + confidence * s; the unobserved part
+//of each system is the shared gramian of the fixed side, so a pass stays linear
+//in the number of observed pairs
+template<typename T>
+class ALSMFSolver : public MFSolver<T> {
+public:
+	ALSMFSolver() : MFSolver<T>(), num_threads_(0), implicit_(false), confidence_(1) {}
+	virtual ~ALSMFSolver() {}
+
+	void SetImplicit(T confidence) { implicit_ = true; confidence_ = confidence; }
+
+	bool Train(const char* train_file, size_t epoch, size_t num_threads);
+
+protected:
+	//refit rows of x (offset x_base in u_) against the fixed rows y (offset y_base)
+	void SolveRows(const RatingMatrix<T>& ratings, size_t x_base, size_t y_base);
+	double CalcRMSE(const RatingMatrix<T>& by_user);
+	//y^T y over the rows [y_base, y_base + n) of u_, full n x n
+	void CalcGramian(size_t y_base, size_t n, std::vector<double>& gram);
+
+protected:
+	size_t num_threads_;
+	bool implicit_;
+	T confidence_;
+	RatingMatrix<T> by_user_;
+	RatingMatrix<T> by_item_;
+};
+
+template<typename T>
+void ALSMFSolver<T>::CalcGramian(size_t y_base, size_t y_num, std::vector<double>& gram) {
+	T** u = MFSolver<T>::u_;
+	const int n = MFSolver<T>::l_dim_;
+
+	std::vector<std::vector<double> > parts(num_threads_, std::vector<double>(n * n, 0.));
+	auto worker_func = [&] (size_t t) {
+		std::vector<double>& g = parts[t];
+		for (size_t r = t; r < y_num; r += num_threads_) {
+			const T* y = u[y_base + r];
+			for (int i = 0; i < n; ++i) {
+				for (int j = 0; j <= i; ++j)
+					g[i * n + j] += y[i] * y[j];
+			}
+		}
+	};
+	util_parallel_run(worker_func, num_threads_);
+
+	gram.assign(n * n, 0.);
+	for (size_t t = 0; t < num_threads_; ++t) {
+		for (int k = 0; k < n * n; ++k) gram[k] += parts[t][k];
+	}
+	for (int i = 0; i < n; ++i) {
+		for (int j = 0; j < i; ++j) gram[j * n + i] = gram[i * n + j];
+	}
+}
+
+template<typename T>
+void ALSMFSolver<T>::SolveRows(const RatingMatrix<T>& ratings, size_t x_base, size_t y_base) {
+	T** u = MFSolver<T>::u_;
+	const int n = MFSolver<T>::l_dim_;
+	const double l2 = MFSolver<T>::l2_;
+	const double confidence = confidence_;
+
+	std::vector<double> gram;
+	if (implicit_) CalcGramian(y_base, ratings.col_num(), gram);
+
+	auto solve_row = [&] (size_t r) {
+		T* x = u[x_base + r];
+		size_t begin = ratings.row_begin(r), end = ratings.row_end(r);
+		if (begin == end) {
+			//with no positives the implicit optimum is the zero vector
+			if (implicit_) std::fill(x, x + n, static_cast<T>(0));
+			return;
+		}
+
+		thread_local std::vector<double> a, b;
+		if (implicit_)
+			a.assign(gram.begin(), gram.end());
+		else
+			a.assign(n * n, 0.);
+		b.assign(n, 0.);
+		for (size_t k = begin; k < end; ++k) {
+			const T* y = u[y_base + ratings.col(k)];
+			//implicit rows only add the sparse correction (c - 1) y y^T on top of the gramian
+			double score = implicit_ ? 1. + confidence * std::max<double>(ratings.val(k), 0.) : ratings.val(k);
+			double weight = implicit_ ? score - 1. : 1.;
+			for (int i = 0; i < n; ++i) {
+				b[i] += score * y[i];
+				double wy = weight * y[i];
+				for (int j = 0; j <= i; ++j)
+					a[i * n + j] += wy * y[j];
+			}
+		}
+		//weighted lambda: the l2 term is paid once per rating, as in the SGD update
+		double reg = implicit_ ? l2 : l2 * (end - begin);
+		for (int i = 0; i < n; ++i) {
+			a[i * n + i] += reg;
+			for (int j = 0; j < i; ++j) a[j * n + i] = a[i * n + j];
+		}
+		if (!cholesky_solve(&a[0], &b[0], n)) return;
+
+		for (int i = 0; i < n; ++i) x[i] = static_cast<T>(b[i]);
+	};
+	util_parallel_for(ratings.row_num(), solve_row, num_threads_);
+}
+
+template<typename T>
+double ALSMFSolver<T>::CalcRMSE(const RatingMatrix<T>& by_user) {
+	T** u = MFSolver<T>::u_;
+	const int n = MFSolver<T>::l_dim_;
+	const size_t user_num = MFSolver<T>::user_num_;
+
+	std::vector<double> sse(num_threads_, 0.);
+	auto worker_func = [&] (size_t t) {
+		double local_sse = 0.;
+		for (size_t r = t; r < by_user.row_num(); r += num_threads_) {
+			for (size_t k = by_user.row_begin(r); k < by_user.row_end(r); ++k) {
+				const T* v = u[user_num + by_user.col(k)];
+				double ruv = 0.;
+				for (int l = 0; l < n; ++l) ruv += u[r][l] * v[l];
+				//implicit mode measures the fit of the observed preferences
+				double target = implicit_ ? 1. : by_user.val(k);
+				local_sse += (ruv - target) * (ruv - target);
+			}
+		}
+		sse[t] = local_sse;
+	};
+	util_parallel_run(worker_func, num_threads_);
+
+	double total = 0.;
+	for (size_t t = 0; t < num_threads_; ++t) total += sse[t];
+	return sqrt(total / std::max<size_t>(1, by_user.nnz()));
+}
+
+template<typename T>
+bool ALSMFSolver<T>::Train(const char* train_file, size_t epoch, size_t num_threads) {
+	if (!MFSolver<T>::init_) return false;
+
+	num_threads_ = num_threads == 0 ? std::thread::hardware_concurrency() : num_threads;
+	if (!by_user_.Load(train_file, MFSolver<T>::user_num_, MFSolver<T>::item_num_, num_threads_))
+		return false;
+	//implicit confidence grows with the total count of a pair, not with how often it is listed
+	if (implicit_) by_user_.MergeDuplicates();
+	by_user_.Transpose(by_item_);
+
+	fprintf(stdout, "%s params={l2:%.4f, confidence:%.4f, epoch:%zu, threads:%zu}\n",
+		implicit_ ? "ials" : "als", static_cast<float>(MFSolver<T>::l2_),
+		static_cast<float>(confidence_), epoch, num_threads_);
+
+	StopWatch timer;
+	for (size_t iter = 0; iter < epoch; ++iter) {
+		SolveRows(by_user_, 0, MFSolver<T>::user_num_);
+		SolveRows(by_item_, MFSolver<T>::user_num_, 0);
+		fprintf(stdout, "epoch=%zu processed=[%zu],avg rmse is [%f], elapsed %.1fs\n",
+			iter, by_user_.nnz(), CalcRMSE(by_user_), timer.StopTimer());
+	}
+	return true;
+}
+
+#endif // SRC_ALS_MF_SOLVER_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
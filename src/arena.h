@@ -0,0 +1,173 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef SRC_ARENA_H
+#define SRC_ARENA_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <sys/mman.h>
+
+//process wide switch, set before the models are allocated
+inline bool& huge_pages_enabled() {
+	static bool enabled = false;
+	return enabled;
+}
+
+//factors in one mapping kept on normal pages, the baseline huge pages are measured against
+inline bool& normal_pages_arena() {
+	static bool enabled = false;
+	return enabled;
+}
+
+inline bool factor_arena_enabled() { return huge_pages_enabled() || normal_pages_arena(); }
+
+//one anonymous mapping for a whole factor matrix, on normal pages unless huge pages are
+//enabled. explicit huge pages (1 GB when the
+//matrix is at least that large, then 2 MB) are tried first, they need pages reserved
+//through vm.nr_hugepages; otherwise normal pages are advised as transparent huge pages.
+//pages are not touched here, they land on the node of the thread that writes them first
+class FactorArena {
+public:
+	FactorArena() : base_(NULL), bytes_(0), kind_("none"), fd_(-1) {}
+	~FactorArena() {
+		if (base_) munmap(base_, bytes_);
+		if (fd_ >= 0) close(fd_);
+	}
+
+	bool Map(size_t bytes) {
+		const size_t k2M = 1UL << 21;
+		if (!huge_pages_enabled()) {
+			if (!MapHuge(RoundUp(bytes, static_cast<size_t>(sysconf(_SC_PAGESIZE))), 0)) return false;
+#ifdef MADV_NOHUGEPAGE
+			madvise(base_, bytes_, MADV_NOHUGEPAGE);
+#endif
+			kind_ = "normal";
+			return true;
+		}
+#ifdef MAP_HUGETLB
+#ifdef MAP_HUGE_1GB
+		const size_t k1G = 1UL << 30;
+		if (bytes >= k1G && MapHuge(RoundUp(bytes, k1G), MAP_HUGETLB | MAP_HUGE_1GB)) {
+			kind_ = "1GB";
+			return true;
+		}
+#endif
+		if (MapHuge(RoundUp(bytes, k2M), MAP_HUGETLB)) {
+			kind_ = "2MB";
+			return true;
+		}
+#endif
+		if (!MapHuge(RoundUp(bytes, k2M), 0)) return false;
+#ifdef MADV_HUGEPAGE
+		madvise(base_, bytes_, MADV_HUGEPAGE);
+		kind_ = "transparent huge";
+#else
+		kind_ = "normal";
+#endif
+		return true;
+	}
+
+	//a shared mapping of path grown to bytes, for matrices larger than memory: rows are
+	//paged in on access and dirty pages are written back to the file by the kernel.
+	//the fd stays open so Evict can start the writeback of a range itself
+	bool MapFile(const char* path, size_t bytes) {
+		int fd = open(path, O_RDWR | O_CREAT, 0644);
+		if (fd < 0) return false;
+		if (ftruncate(fd, bytes) != 0) {
+			close(fd);
+			return false;
+		}
+		void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) {
+			close(fd);
+			return false;
+		}
+		base_ = p;
+		bytes_ = bytes;
+		kind_ = "file";
+		fd_ = fd;
+		return true;
+	}
+
+	//a read only shared mapping of the whole file at path. processes mapping the same
+	//file share its page cache copy
+	bool MapReadOnly(const char* path) {
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) return false;
+		off_t bytes = lseek(fd, 0, SEEK_END);
+		void* p = bytes > 0 ? mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+		close(fd);
+		if (p == MAP_FAILED) return false;
+		base_ = p;
+		bytes_ = bytes;
+		kind_ = "read only file";
+		return true;
+	}
+
+	//[p, p + n) is needed soon, read it ahead
+	void Prefetch(const void* p, size_t n) const { Advise(p, n, MADV_WILLNEED, false); }
+	//[p, p + n) is not needed for a while, start its writeback and drop it from
+	//the page tables so the kernel can reclaim it first
+	void Evict(const void* p, size_t n) const { Advise(p, n, MADV_DONTNEED, true); }
+
+	void* base() const { return base_; }
+	size_t bytes() const { return bytes_; }
+	const char* kind() const { return kind_; }
+
+private:
+	FactorArena(const FactorArena&);
+	FactorArena& operator=(const FactorArena&);
+
+	static size_t RoundUp(size_t n, size_t align) { return (n + align - 1) / align * align; }
+
+	void Advise(const void* p, size_t n, int advice, bool sync) const {
+		const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+		uintptr_t begin = reinterpret_cast<uintptr_t>(p) / page * page;
+		uintptr_t end = reinterpret_cast<uintptr_t>(p) + n;
+		void* start = reinterpret_cast<void*>(begin);
+#ifdef SYNC_FILE_RANGE_WRITE
+		//msync(MS_ASYNC) only marks the pages dirty on linux, this queues their io
+		if (sync && fd_ >= 0)
+			sync_file_range(fd_, begin - reinterpret_cast<uintptr_t>(base_), end - begin, SYNC_FILE_RANGE_WRITE);
+#endif
+		madvise(start, end - begin, advice);
+	}
+
+	bool MapHuge(size_t bytes, int flags) {
+		void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+		if (p == MAP_FAILED) return false;
+		base_ = p;
+		bytes_ = bytes;
+		return true;
+	}
+
+	void* base_;
+	size_t bytes_;
+	const char* kind_;
+	int fd_;	//backing file of MapFile, -1 otherwise
+};
+
+#endif // SRC_ARENA_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
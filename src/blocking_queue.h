@@ -0,0 +1,77 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_BLOCKING_QUEUE_H
+#define SRC_BLOCKING_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+//bounded multi producer multi consumer queue, Pop fails once closed and drained
+template<typename E>
+class BlockingQueue {
+public:
+	explicit BlockingQueue(size_t capacity = 4) : capacity_(capacity), closed_(false) {}
+
+	bool Push(E&& e) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		not_full_.wait(lock, [this] { return closed_ || queue_.size() < capacity_; });
+		if (closed_) return false;
+		queue_.push_back(std::move(e));
+		not_empty_.notify_one();
+		return true;
+	}
+
+	bool Pop(E& e) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		not_empty_.wait(lock, [this] { return closed_ || !queue_.empty(); });
+		if (queue_.empty()) return false;
+		e = std::move(queue_.front());
+		queue_.pop_front();
+		not_full_.notify_one();
+		return true;
+	}
+
+	void Close() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		closed_ = true;
+		not_empty_.notify_all();
+		not_full_.notify_all();
+	}
+
+	void Reopen() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		queue_.clear();
+		closed_ = false;
+	}
+
+private:
+	size_t capacity_;
+	bool closed_;
+	std::deque<E> queue_;
+	std::mutex mutex_;
+	std::condition_variable not_empty_;
+	std::condition_variable not_full_;
+};
+
+#endif // SRC_BLOCKING_QUEUE_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
@@ -0,0 +1,172 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_CCD_MF_SOLVER_H
+#define SRC_CCD_MF_SOLVER_H
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <vector>
+#include "src/mf_solver.h"
+#include "src/rating_matrix.h"
+#include "src/stopwatch.h"
+#include "src/util.h"
+
+//CCD++: rank one coordinate descent, one latent feature at a time.
+//factors are kept feature major and the residual of every rating is kept
+//both in user order and in item order, so each pass is a contiguous sweep
+template<typename T>
+class CCDMFSolver : public MFSolver<T> {
+public:
+	CCDMFSolver() : MFSolver<T>(), num_threads_(0), warm_(false) {}
+	virtual ~CCDMFSolver() {}
+
+	//a loaded model keeps its user rows, Train starts from them instead of zero
+	virtual bool LoadModel(const char* path) {
+		warm_ = MFSolver<T>::LoadModel(path);
+		return warm_;
+	}
+
+	bool Train(const char* train_file, size_t epoch, size_t num_threads);
+
+private:
+	enum { kInnerIter = 3 };
+
+	//x[r] = sum(res * y) / (l2 * n_r + sum(y * y)) over the ratings of row r
+	void SolveFeature(const RatingMatrix<T>& ratings, const std::vector<T>& res,
+		const T* y, T* x);
+	//res += sign * x[row] * y[col] for every rating
+	void UpdateResidual(const RatingMatrix<T>& ratings, std::vector<T>& res,
+		const T* x, const T* y, T sign);
+
+	size_t num_threads_;
+	bool warm_;
+	RatingMatrix<T> by_user_;
+	RatingMatrix<T> by_item_;
+	std::vector<T> res_user_;
+	std::vector<T> res_item_;
+	std::vector<T> w_;	//l_dim x user_num
+	std::vector<T> h_;	//l_dim x item_num
+};
+
+template<typename T>
+void CCDMFSolver<T>::SolveFeature(const RatingMatrix<T>& ratings, const std::vector<T>& res,
+		const T* y, T* x) {
+	const double l2 = MFSolver<T>::l2_;
+	const std::vector<int>& cols = ratings.cols();
+	auto solve_row = [&] (size_t r) {
+		size_t begin = ratings.row_begin(r), end = ratings.row_end(r);
+		if (begin == end) return;
+		double num = 0., den = l2 * (end - begin);
+		for (size_t k = begin; k < end; ++k) {
+			T yk = y[cols[k]];
+			num += res[k] * yk;
+			den += yk * yk;
+		}
+		x[r] = static_cast<T>(num / den);
+	};
+	util_parallel_for(ratings.row_num(), solve_row, num_threads_);
+}
+
+template<typename T>
+void CCDMFSolver<T>::UpdateResidual(const RatingMatrix<T>& ratings, std::vector<T>& res,
+		const T* x, const T* y, T sign) {
+	const std::vector<int>& cols = ratings.cols();
+	auto update_row = [&] (size_t r) {
+		T xr = sign * x[r];
+		if (xr == 0) return;
+		for (size_t k = ratings.row_begin(r); k < ratings.row_end(r); ++k)
+			res[k] += xr * y[cols[k]];
+	};
+	util_parallel_for(ratings.row_num(), update_row, num_threads_);
+}
+
+template<typename T>
+bool CCDMFSolver<T>::Train(const char* train_file, size_t epoch, size_t num_threads) {
+	if (!MFSolver<T>::init_) return false;
+
+	num_threads_ = num_threads == 0 ? std::thread::hardware_concurrency() : num_threads;
+	const size_t user_num = MFSolver<T>::user_num_;
+	const size_t item_num = MFSolver<T>::item_num_;
+	const int l_dim = MFSolver<T>::l_dim_;
+	T** u = MFSolver<T>::u_;
+
+	if (!by_user_.Load(train_file, user_num, item_num, num_threads_))
+		return false;
+	by_user_.Transpose(by_item_);
+
+	//cold, users start at zero so the residual starts as the ratings themselves.
+	//warm, users start from the loaded rows and their features are taken out of it
+	w_.assign(l_dim * user_num, 0);
+	if (warm_) {
+		for (size_t i = 0; i < user_num; ++i) {
+			for (int t = 0; t < l_dim; ++t)
+				w_[t * user_num + i] = u[i][t];
+		}
+	}
+	h_.resize(l_dim * item_num);
+	for (size_t j = 0; j < item_num; ++j) {
+		for (int t = 0; t < l_dim; ++t)
+			h_[t * item_num + j] = u[user_num + j][t];
+	}
+	res_user_ = by_user_.vals();
+	res_item_ = by_item_.vals();
+	for (int t = 0; warm_ && t < l_dim; ++t) {
+		UpdateResidual(by_user_, res_user_, &w_[t * user_num], &h_[t * item_num], -1);
+		UpdateResidual(by_item_, res_item_, &h_[t * item_num], &w_[t * user_num], -1);
+	}
+
+	fprintf(stdout, "ccd++ params={l2:%.4f, epoch:%zu, threads:%zu}\n",
+		static_cast<float>(MFSolver<T>::l2_), epoch, num_threads_);
+
+	StopWatch timer;
+	for (size_t iter = 0; iter < epoch; ++iter) {
+		for (int t = 0; t < l_dim; ++t) {
+			T* wt = &w_[t * user_num];
+			T* ht = &h_[t * item_num];
+			//take feature t out of the residual, refit it, and put it back
+			UpdateResidual(by_user_, res_user_, wt, ht, 1);
+			UpdateResidual(by_item_, res_item_, ht, wt, 1);
+			for (int k = 0; k < kInnerIter; ++k) {
+				SolveFeature(by_user_, res_user_, ht, wt);
+				SolveFeature(by_item_, res_item_, wt, ht);
+			}
+			UpdateResidual(by_user_, res_user_, wt, ht, -1);
+			UpdateResidual(by_item_, res_item_, ht, wt, -1);
+		}
+
+		double sse = 0.;
+		for (size_t k = 0; k < res_user_.size(); ++k) sse += res_user_[k] * res_user_[k];
+		fprintf(stdout, "epoch=%zu processed=[%zu],avg rmse is [%f], elapsed %.1fs\n",
+			iter, by_user_.nnz(), sqrt(sse / std::max<size_t>(1, by_user_.nnz())), timer.StopTimer());
+	}
+
+	for (size_t i = 0; i < user_num; ++i) {
+		for (int t = 0; t < l_dim; ++t) u[i][t] = w_[t * user_num + i];
+	}
+	for (size_t j = 0; j < item_num; ++j) {
+		for (int t = 0; t < l_dim; ++t) u[user_num + j][t] = h_[t * item_num + j];
+	}
+	return true;
+}
+
+#endif // SRC_CCD_MF_SOLVER_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
@@ -22,12 +22,19 @@
 #define SRC_FAST_MF_SOLVER_H
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
 #include <functional>
 #include <utility>
 #include <vector>
 #include <map>
+#include <random>
+#include "src/alias_sampler.h"
 #include "src/mf_solver.h"
 #include "src/lock.h"
+#include "src/row_optimizer.h"
+#include "src/row_map.h"
 
 extern const double rand_val ;
 enum { kParamGroupSize = 1, kFetchStep = 3, kPushStep = 3 };
@@ -39,27 +46,114 @@ inline size_t calc_group_num(size_t n) {
 template<typename T>
 class MFParamServer : public MFSolver<T> {
 public:
+	typedef typename MFSolver<T>::C C;
+
 	MFParamServer();
 
 	virtual ~MFParamServer();
 
 	virtual bool Initialize(
-		T alpha,
-		T l2,
+		C alpha,
+		C l2,
 		size_t user_num,size_t item_num,int latent_dim);
-	virtual bool Initialize(const char* path);
 	bool FetchParamGroup(T** u, size_t group);
 	bool FetchParam(T** u);
 	bool PushParamGroup(T** u, size_t group);
 
+	//per row learning rate state shared by all workers, sgd keeps none
+	void SetOptimizer(OptimizerType type) {
+		optimizer_.Initialize(type, MFSolver<T>::feat_num_, MFSolver<T>::l_dim_);
+	}
+	RowOptimizer<C>* optimizer() { return &optimizer_; }
+	//the lock a row is fetched and pushed under
+	SpinLock* row_lock(size_t row) { return &lock_slots_[row / kParamGroupSize]; }
+
+	//lazy l2: the l2 term is left out of the update and a row counts the updates it has
+	//not been decayed for. it pays (1 - alpha * l2) for each of them when it is next
+	//touched, the shrinkage the eager update would have applied, one scale per touch
+	void SetLazyL2(bool lazy_l2);
+	bool lazy_l2() const { return lazy_l2_; }
+	//the decay factor row owes, its count restarts at this update
+	C ClaimDecay(size_t row) { return TakeDecay(row, 1); }
+	//apply the decay every row still owes, before the model is read
+	void FlushDecay();
+
+	//spread the rows over numa nodes before Initialize: user u lives on the node of
+	//worker u % worker_nodes.size(), items are cut into one contiguous range per node.
+	//each node holds its rows in one block first touched by pool threads of that node
+	void SetNumaLayout(const std::vector<int>& worker_nodes) { worker_nodes_ = worker_nodes; }
+	bool numa() const { return !worker_nodes_.empty(); }
+	inline int RowNode(size_t row) const {
+		if (row < MFSolver<T>::user_num_) return worker_nodes_[row % worker_nodes_.size()];
+		int k = 0;
+		while (row >= item_node_end_[k]) ++k;
+		return k;
+	}
+
+	//dynamic ids, set before Initialize: rows are keyed by raw ids and created on first
+	//sight, the ./feat_num counts only presize the maps. the model is saved in the dense
+	//format with the raw id of every row in path.ids
+	void SetDynamicIds(bool dynamic_ids) { dynamic_ids_ = dynamic_ids; }
+	bool dynamic_ids() const { return dynamic_ids_; }
+	inline T* UserRow(uint64_t id) { return dynamic_rows_.row(UserIndex(id)); }
+	inline T* ItemRow(uint64_t id) { return dynamic_rows_.row(ItemIndex(id)); }
+	//index of the row of an id among the dynamic rows, created on first sight
+	inline uint64_t UserIndex(uint64_t id) { return DynamicIndex(user_map_, id, id); }
+	inline uint64_t ItemIndex(uint64_t id) { return DynamicIndex(item_map_, id, ~id); }
+	//index of the row of an id, kNoRow when it has none yet. nothing is created
+	inline uint64_t FindUserIndex(uint64_t id) const { return user_map_.Find(id); }
+	inline uint64_t FindItemIndex(uint64_t id) const { return item_map_.Find(id); }
+	//dynamic row r and its lock, workers update a row only while holding its lock
+	inline T* dynamic_row(uint64_t r) const { return dynamic_rows_.row(r); }
+	inline SpinLock* dynamic_lock(uint64_t r) const { return dynamic_rows_.lock(r); }
+	virtual bool SaveModel(const char* path);
+	//with dynamic ids the rows of path are keyed by the raw ids of path.ids, or by their
+	//dense ids when it has none, and rows missing from this server are created
+	virtual bool LoadModel(const char* path);
+
 private:
+	void AllocNumaRows();
+	//the decay factor row owes, its count of undecayed updates becomes next
+	C TakeDecay(size_t row, uint32_t next);
+	//a new row is filled from the init stream of stream_id, so it does not depend on
+	//which thread meets the id first
+	inline uint64_t DynamicIndex(ConcurrentRowMap& map, uint64_t id, uint64_t stream_id) {
+		uint64_t row = map.Find(id);
+		if (row == ConcurrentRowMap::kNoRow) {
+			row = map.FindOrInsert(id, [&] () {
+				uint64_t r = dynamic_rows_.Allocate();
+				MFSolver<T>::fill_row_rand(dynamic_rows_.row(r), util_hash64(stream_id), MFSolver<T>::l_dim_, 0.01);
+				return r;
+			});
+		}
+		return row;
+	}
+
 	size_t param_group_num_;
 	SpinLock* lock_slots_;
+	RowOptimizer<C> optimizer_;
+
+	bool lazy_l2_;
+	double decay_;						//1 - alpha * l2, the eager shrinkage of one update
+	std::atomic<uint32_t>* undecayed_;	//per row updates not decayed for yet
+
+	std::vector<int> worker_nodes_;
+	size_t node_num_;
+	std::vector<size_t> item_node_end_;	//end row of the item range of each node
+	std::vector<T*> node_blocks_;
+	std::vector<T*> heap_blocks_;	//node blocks not in an arena
+
+	bool dynamic_ids_;
+	ConcurrentRowMap user_map_;
+	ConcurrentRowMap item_map_;
+	RowChunks<T> dynamic_rows_;
 };
 
 template<typename T>
 class MFWorker : public MFSolver<T> {
 public:
+	typedef typename MFSolver<T>::C C;
+
 	MFWorker();
 
 	virtual ~MFWorker();
@@ -72,17 +166,110 @@ public:
 	bool Reset(MFParamServer<T>* param_server);
 
 	bool Initialize(
-		T alpha,
-		T l2,
+		C alpha,
+		C l2,
 		size_t n) { return false; }
 
 	bool Initialize(const char* path) { return false; }
 
-	T Update(const std::vector<int>& x,MFParamServer<T>* param_server);
-	T Update(T& score,const std::vector<int>& x,MFParamServer<T>* param_server);
+	C Update(const std::vector<mf_id_t>& x,MFParamServer<T>* param_server);
+	//train on the pairs of one line, return their summed loss and add their number to
+	//trained. held out pairs are scored, not trained and not counted
+	C Update(C& score,const std::vector<mf_id_t>& x,MFParamServer<T>* param_server,size_t& trained);
+	//bpr pairwise ranking: every listed item is a positive, negatives come from the sampler
+	C UpdateBPR(const std::vector<mf_id_t>& x,MFParamServer<T>* param_server,size_t& trained);
+	//squared loss on the rows of a dynamic id server, updated in place under their row locks
+	C UpdateDynamic(C& score,const std::vector<mf_id_t>& x,MFParamServer<T>* param_server,size_t& trained);
 
 	bool PushParam(MFParamServer<T>* param_server);
 
+	//hot item rows bypass the per-update fetch/push and are merged in bulk
+	void SetHotItems(size_t hot_num) { hot_num_ = hot_num; }
+	//user rows routed exclusively to this worker are updated in place on the server
+	void SetUserOwned(bool user_owned) { user_owned_ = user_owned; }
+	bool RefreshHotRows(MFParamServer<T>* param_server);
+	bool MergeHotRows(MFParamServer<T>* param_server);
+	//pairs whose hash falls in fold out of folds are scored before any update and
+	//never trained on, the same pairs every epoch and on every thread
+	void SetHoldout(size_t folds, size_t fold) { folds_ = folds; fold_ = fold; }
+	//numa node of the pool thread running this worker, -1 when unknown
+	void SetNode(int node) { node_ = node; }
+	//server row accesses on this worker's node and on other nodes since the last call
+	void TakeAccessStats(size_t& local, size_t& remote) {
+		local = local_access_; remote = remote_access_;
+		local_access_ = 0; remote_access_ = 0;
+	}
+	//held out loss sum and pair count since the last call
+	void TakeValidation(double& loss, size_t& count) {
+		loss = valid_loss_; count = valid_count_;
+		valid_loss_ = 0.; valid_count_ = 0;
+	}
+	//switch Update to the bpr loss, sampler is shared read only between workers
+	void SetNegativeSampler(const AliasSampler* sampler, uint64_t seed) {
+		neg_sampler_ = sampler;
+		rand_.seed(seed);
+	}
+
+private:
+	//sync a shared row with the server when its fetch/push step is due
+	inline void FetchRow(size_t row, MFParamServer<T>* param_server) {
+		if (shared_rows_) return;
+		size_t g = row / kParamGroupSize;
+		if (param_group_step_[g] % fetch_step_ == 0)
+			param_server->FetchParamGroup(MFSolver<T>::u_,g);
+	}
+	//refresh a shared row from the server now, before a held out pair is scored on it
+	inline void FetchRowNow(size_t row, MFParamServer<T>* param_server) {
+		if (shared_rows_) return;
+		param_server->FetchParamGroup(MFSolver<T>::u_, row / kParamGroupSize);
+	}
+	inline void PushRow(size_t row, MFParamServer<T>* param_server) {
+		if (shared_rows_) return;
+		size_t g = row / kParamGroupSize;
+		if (param_group_step_[g] % push_step_ == 0)
+			param_server->PushParamGroup(u_update_,g);
+		param_group_step_[g] += 1;
+	}
+	//pay the lazy l2 decay a row owes, on the local copy and on its delta
+	inline void DecayRow(size_t row, T* local, T* delta, MFParamServer<T>* param_server) {
+		C f = param_server->ClaimDecay(row);
+		if (f == 1) return;
+		for (int l = 0; l < MFSolver<T>::l_dim_; ++l) {
+			C d = (f - 1) * local[l];
+			delta[l] += d;
+			if (local != delta) local[l] += d;
+		}
+	}
+	inline void CountAccess(size_t row, const MFParamServer<T>* param_server) {
+		if (param_server->RowNode(row) == node_) ++local_access_;
+		else ++remote_access_;
+	}
+	inline bool IsHeldOut(mf_id_t user, mf_id_t item) const {
+		if (folds_ == 0) return false;
+		//(user << 32) | item for 32 bit ids, the high user bits are folded in through the hash
+		uint64_t u = static_cast<uint64_t>(user);
+		uint64_t key = (u << 32) ^ static_cast<uint64_t>(item) ^ util_hash64(u >> 32);
+		return util_hash64(key) % folds_ == fold_;
+	}
+	//a sampled negative item row other than the positive row i. when a few draws only
+	//give i back, as a very popular i can, any other item is taken uniformly.
+	//feat_num_ when there is no other item
+	inline size_t SampleNegative(size_t i) {
+		const size_t users = MFSolver<T>::user_num_, items = MFSolver<T>::item_num_;
+		for (int tries = 0; tries < 4; ++tries) {
+			size_t k = neg_sampler_->Sample(rand_()) + users;
+			if (k != i && k < MFSolver<T>::feat_num_) return k;
+		}
+		if (items < 2) return MFSolver<T>::feat_num_;
+		size_t r = rand_() % (items - 1);
+		return users + (r >= i - users ? r + 1 : r);
+	}
+	inline bool IsHotItem(mf_id_t item) {
+		if (hot_num_ == 0) return false;
+		++item_hits_[item];
+		return hot_[item];
+	}
+
 private:
 	size_t param_group_num_;
 	size_t* param_group_step_;
@@ -90,27 +277,170 @@ private:
 	size_t fetch_step_;
 
 	T** u_update_;
+	bool update_arena_;	//the rows of u_update_ point into an arena, like arena_rows_ for u_
+	//out of core and dynamic ids: the replica and the deltas are the server rows themselves,
+	//nothing is copied and every worker updates them in place, under their row locks
+	bool shared_rows_;
+
+	bool user_owned_;
+
+	size_t hot_num_;
+	std::vector<uint64_t> item_hits_;	//halved at every refresh, so older epochs fade
+	std::vector<char> hot_;
+	std::vector<size_t> hot_rows_;
+
+	const AliasSampler* neg_sampler_;
+	std::mt19937_64 rand_;
+
+	//gradients of the rows touched by one update, scaled by the row optimizer
+	std::vector<C> user_grad_;
+	std::vector<C> item_grad_;
+	std::vector<C> neg_grad_;
+
+	size_t folds_;
+	size_t fold_;
+	double valid_loss_;
+	size_t valid_count_;
+
+	int node_;
+	size_t local_access_;
+	size_t remote_access_;
 };
 
 
 
 template<typename T>
 MFParamServer<T>::MFParamServer()
-: MFSolver<T>(), param_group_num_(0), lock_slots_(NULL) {}
+: MFSolver<T>(), param_group_num_(0), lock_slots_(NULL),
+lazy_l2_(false), decay_(1.), undecayed_(NULL), node_num_(1), dynamic_ids_(false) {}
 
 template<typename T>
 MFParamServer<T>::~MFParamServer() {
 	if (lock_slots_) {
 		delete [] lock_slots_;
 	}
+	if (undecayed_) {
+		delete [] undecayed_;
+	}
+	if (!node_blocks_.empty()) {
+		//rows point into the node blocks, they are not owned one by one
+		delete [] MFSolver<T>::u_;
+		MFSolver<T>::u_ = NULL;
+		for (size_t k = 0; k < heap_blocks_.size(); ++k) delete [] heap_blocks_[k];
+	}
+}
+
+template<typename T>
+void MFParamServer<T>::AllocNumaRows() {
+	const size_t n = MFSolver<T>::feat_num_;
+	const int l_dim = MFSolver<T>::l_dim_;
+	node_num_ = *std::max_element(worker_nodes_.begin(), worker_nodes_.end()) + 1;
+	//item j goes to node j * node_num_ / item_num, the ranges are cut once here
+	const size_t items = MFSolver<T>::item_num_;
+	item_node_end_.resize(node_num_);
+	for (size_t k = 0; k < node_num_; ++k)
+		item_node_end_[k] = MFSolver<T>::user_num_ + ((k + 1) * items + node_num_ - 1) / node_num_;
+
+	const size_t users = MFSolver<T>::user_num_;
+	const size_t threads = worker_nodes_.size();
+	auto item_begin = [&] (size_t k) { return k == 0 ? users : item_node_end_[k - 1]; };
+
+	//node k holds the users of its workers, then its item range
+	std::vector<size_t> rows(node_num_, 0);
+	for (size_t w = 0; w < threads && w < users; ++w)
+		rows[worker_nodes_[w]] += (users - w + threads - 1) / threads;
+	for (size_t k = 0; k < node_num_; ++k) rows[k] += item_node_end_[k] - item_begin(k);
+	//blocks are only reserved here, the pages land on the node that writes them first
+	node_blocks_.assign(node_num_, NULL);
+	std::vector<size_t> next(node_num_, 0);
+	for (size_t k = 0; k < node_num_; ++k) {
+		size_t elems = std::max<size_t>(1, rows[k]) * l_dim;
+		node_blocks_[k] = MFSolver<T>::AllocArenaBlock(elems);
+		if (node_blocks_[k] == NULL) {
+			node_blocks_[k] = new T[elems];
+			heap_blocks_.push_back(node_blocks_[k]);
+		}
+	}
+	MFSolver<T>::u_ = new T*[n];
+	for (size_t i = 0, w = 0; i < users; ++i, w = w + 1 == threads ? 0 : w + 1) {
+		int k = worker_nodes_[w];
+		MFSolver<T>::u_[i] = node_blocks_[k] + next[k]++ * l_dim;
+	}
+	for (size_t k = 0; k < node_num_; ++k) {
+		for (size_t i = item_begin(k); i < item_node_end_[k]; ++i)
+			MFSolver<T>::u_[i] = node_blocks_[k] + next[k]++ * l_dim;
+	}
+
+	//worker thread t fills its users t, t + threads, ... and an even share of the item
+	//range of its node with the other workers there, all rows of its own node
+	std::vector<size_t> rank(threads), peers(node_num_, 0);
+	for (size_t t = 0; t < threads; ++t) rank[t] = peers[worker_nodes_[t]]++;
+	auto fill_func = [&] (size_t t) {
+		for (size_t i = t; i < users; i += threads)
+			MFSolver<T>::fill_row_rand(MFSolver<T>::u_[i], i, l_dim, 0.01);
+		int k = worker_nodes_[t];
+		size_t begin = item_begin(k), len = item_node_end_[k] - begin;
+		size_t end = begin + len * (rank[t] + 1) / peers[k];
+		for (size_t i = begin + len * rank[t] / peers[k]; i < end; ++i)
+			MFSolver<T>::fill_row_rand(MFSolver<T>::u_[i], i, l_dim, 0.01);
+	};
+	util_parallel_run(fill_func, threads);
+}
+
+template<typename T>
+void MFParamServer<T>::SetLazyL2(bool lazy_l2) {
+	lazy_l2_ = lazy_l2;
+	if (!lazy_l2_ || undecayed_) return;
+
+	decay_ = 1. - std::min(0.5, static_cast<double>(MFSolver<T>::alpha_ * MFSolver<T>::l2_));
+	undecayed_ = new std::atomic<uint32_t>[MFSolver<T>::feat_num_];
+	for (size_t i = 0; i < MFSolver<T>::feat_num_; ++i) undecayed_[i] = 0;
+}
+
+template<typename T>
+typename MFParamServer<T>::C MFParamServer<T>::TakeDecay(size_t row, uint32_t next) {
+	uint32_t n = undecayed_[row].exchange(next, std::memory_order_relaxed);
+	if (n == 0) return 1;
+	return static_cast<C>(n == 1 ? decay_ : std::pow(decay_, static_cast<double>(n)));
+}
+
+template<typename T>
+void MFParamServer<T>::FlushDecay() {
+	if (!lazy_l2_) return;
+
+	for (size_t i = 0; i < MFSolver<T>::feat_num_; ++i) {
+		C f = TakeDecay(i, 0);
+		if (f == 1) continue;
+		std::lock_guard<SpinLock> lock(lock_slots_[i / kParamGroupSize]);
+		for (int j = 0; j < MFSolver<T>::l_dim_; ++j)
+			MFSolver<T>::u_[i][j] *= f;
+	}
 }
 
 template<typename T>
 bool MFParamServer<T>::Initialize(
-		T alpha,
-		T l2,
+		C alpha,
+		C l2,
 		size_t user_num,size_t item_num,int latent_dim) {
-	if (!MFSolver<T>::Initialize(alpha, l2, user_num,item_num,latent_dim)) {
+	if (dynamic_ids_) {
+		MFSolver<T>::alpha_ = alpha;
+		MFSolver<T>::l2_ = l2;
+		MFSolver<T>::l_dim_ = latent_dim;
+		user_map_.Reserve(user_num);
+		item_map_.Reserve(item_num);
+		dynamic_rows_.Initialize(latent_dim);
+		MFSolver<T>::init_ = true;
+		return true;
+	}
+	if (numa()) {
+		MFSolver<T>::alpha_ = alpha;
+		MFSolver<T>::l2_ = l2;
+		MFSolver<T>::user_num_ = user_num;
+		MFSolver<T>::item_num_ = item_num;
+		MFSolver<T>::feat_num_ = user_num + item_num;
+		MFSolver<T>::l_dim_ = latent_dim;
+		AllocNumaRows();
+	} else if (!MFSolver<T>::Initialize(alpha, l2, user_num,item_num,latent_dim)) {
 		return false;
 	}
 
@@ -123,18 +453,65 @@ bool MFParamServer<T>::Initialize(
 }
 
 template<typename T>
-bool MFParamServer<T>::Initialize(const char* path) {
-	if (!MFSolver<T>::Initialize(path)) {
+bool MFParamServer<T>::LoadModel(const char* path) {
+	if (!dynamic_ids_) return MFSolver<T>::LoadModel(path);
+	if (!MFSolver<T>::init_) return false;
+
+	size_t user_num = 0, item_num = 0;
+	int l_dim = 0;
+	if (!read_model_shape(path, user_num, item_num, l_dim)) {
+		printf("read model %s failed\n", path);
+		return false;
+	}
+	std::vector<uint64_t> ids;
+	std::ifstream fin((std::string(path) + ".ids").c_str());
+	uint64_t id;
+	while (fin >> id) ids.push_back(id);
+	if (!ids.empty() && ids.size() != user_num + item_num) {
+		printf("%s.ids has %zu ids for %zu rows\n", path, ids.size(), user_num + item_num);
 		return false;
 	}
 
-	param_group_num_ = calc_group_num(MFSolver<T>::feat_num_);
-	lock_slots_ = new SpinLock[param_group_num_];
-
-	MFSolver<T>::init_ = true;
+	const bool keyed = !ids.empty();
+	auto dst = [&] (bool user, size_t k) -> T* {
+		if (user) return UserRow(keyed ? ids[k] : k);
+		return ItemRow(keyed ? ids[user_num + k] : k);
+	};
+	if (!load_model_rows<T>(path, MFSolver<T>::l_dim_, dst, MFSolver<T>::init_threads_)) {
+		printf("load model %s failed\n", path);
+		return false;
+	}
+	printf("init model %s: %zu users, %zu items\n", path, user_num, item_num);
 	return true;
 }
 
+template<typename T>
+bool MFParamServer<T>::SaveModel(const char* path) {
+	if (!dynamic_ids_) return MFSolver<T>::SaveModel(path);
+	if (!MFSolver<T>::init_) return false;
+
+	std::vector<std::pair<uint64_t, uint64_t> > users, items;
+	user_map_.Entries(users);
+	item_map_.Entries(items);
+	const int l_dim = MFSolver<T>::l_dim_;
+
+	std::ofstream ids((std::string(path) + ".ids").c_str());
+	if (!ids.is_open()) return false;
+	for (size_t k = 0; k < users.size(); ++k) ids << users[k].first << "\n";
+	for (size_t k = 0; k < items.size(); ++k) ids << items[k].first << "\n";
+	ids.close();
+	if (ids.fail()) return false;
+
+	const size_t user_num = users.size();
+	const RowChunks<T>& chunks = dynamic_rows_;
+	auto row = [&] (size_t i) -> const T* {
+		return chunks.row(i < user_num ? users[i].second : items[i - user_num].second);
+	};
+	if (MFSolver<T>::binary_model_)
+		return write_binary_model<T>(path, user_num, items.size(), l_dim, row, MFSolver<T>::init_threads_);
+	return write_text_model<T>(path, user_num, items.size(), l_dim, row, MFSolver<T>::init_threads_);
+}
+
 template<typename T>
 bool MFParamServer<T>::FetchParamGroup(T** u, size_t group) {
 	if (!MFSolver<T>::init_) return false;
@@ -183,16 +560,22 @@ bool MFParamServer<T>::PushParamGroup(T** u_update,size_t group) {
 template<typename T>
 MFWorker<T>::MFWorker()
 : MFSolver<T>(), param_group_num_(0), param_group_step_(NULL),
-push_step_(0), fetch_step_(0), u_update_(NULL) {}
+push_step_(0), fetch_step_(0), u_update_(NULL), update_arena_(false), shared_rows_(false), user_owned_(false), hot_num_(0), neg_sampler_(NULL),
+folds_(0), fold_(0), valid_loss_(0.), valid_count_(0),
+node_(-1), local_access_(0), remote_access_(0) {}
 
 template<typename T>
 MFWorker<T>::~MFWorker() {
+	if (shared_rows_) {
+		u_update_ = NULL;
+		MFSolver<T>::u_ = NULL;
+	}
 	if (param_group_step_) {
 		delete [] param_group_step_;
 	}
 
 	if (u_update_) {
-	    for (size_t i = 0; i < MFSolver<T>::feat_num_; ++i) 
+	    for (size_t i = 0; i < MFSolver<T>::feat_num_ && !update_arena_; ++i) 
             if (u_update_[i])
                 delete [] u_update_[i];
         delete [] u_update_;
@@ -209,34 +592,48 @@ bool MFWorker<T>::Initialize(
 	MFSolver<T>::l2_ = param_server->l2();
 	MFSolver<T>::feat_num_ = param_server->feat_num();
 	MFSolver<T>::user_num_ = param_server->user_num();
+	MFSolver<T>::item_num_ = param_server->item_num();
 	MFSolver<T>::l_dim_ = param_server->l_dim();
 
-	u_update_ = new T*[MFSolver<T>::feat_num_];
-    for (size_t i = 0; i < MFSolver<T>::feat_num_; ++i){
-        u_update_[i] = new T[MFSolver<T>::l_dim_];
-    }
-
-    MFSolver<T>::set_float_rand(u_update_,MFSolver<T>::feat_num_,MFSolver<T>::l_dim_,0.0);
-
-    printf("MF fea num:%ld\n",MFSolver<T>::feat_num_);
-    printf("%d dim \n",MFSolver<T>::l_dim_);
-
-	MFSolver<T>::u_ = new T*[MFSolver<T>::feat_num_];
-    for (size_t i = 0; i < MFSolver<T>::feat_num_; ++i) 
-        MFSolver<T>::u_[i] = new T [MFSolver<T>::l_dim_];
-
-    MFSolver<T>::set_float_rand(MFSolver<T>::u_,MFSolver<T>::feat_num_,MFSolver<T>::l_dim_,1.);
+	shared_rows_ = param_server->out_of_core() || param_server->dynamic_ids();
+	if (shared_rows_) {
+		MFSolver<T>::u_ = param_server->rows();
+		u_update_ = param_server->rows();
+	} else {
+		u_update_ = new T*[MFSolver<T>::feat_num_]();
+		update_arena_ = MFSolver<T>::AllocArenaRows(u_update_, MFSolver<T>::feat_num_, MFSolver<T>::l_dim_);
+		MFSolver<T>::set_float_rand(u_update_,MFSolver<T>::feat_num_,MFSolver<T>::l_dim_,0.0);
+
+		printf("MF fea num:%ld\n",MFSolver<T>::feat_num_);
+		printf("%d dim \n",MFSolver<T>::l_dim_);
+
+		//the replica is copied from the server right away, it needs no random fill
+		MFSolver<T>::u_ = new T*[MFSolver<T>::feat_num_];
+		MFSolver<T>::arena_rows_ = MFSolver<T>::AllocArenaRows(MFSolver<T>::u_, MFSolver<T>::feat_num_, MFSolver<T>::l_dim_);
+		if (!MFSolver<T>::arena_rows_) {
+			auto alloc_row = [this] (size_t i) { MFSolver<T>::u_[i] = new T [MFSolver<T>::l_dim_]; };
+			util_parallel_for(MFSolver<T>::feat_num_, alloc_row, std::thread::hardware_concurrency());
+		}
 
-	param_server->FetchParam(MFSolver<T>::u_);
+		param_server->FetchParam(MFSolver<T>::u_);
 
-	param_group_num_ = calc_group_num(MFSolver<T>::feat_num_);
-	param_group_step_ = new size_t[param_group_num_];
-	for (size_t i = 0; i < param_group_num_; ++i) param_group_step_[i] = 0;
-    printf("group fea num:%ld\n",param_group_num_);
+		param_group_num_ = calc_group_num(MFSolver<T>::feat_num_);
+		param_group_step_ = new size_t[param_group_num_];
+		for (size_t i = 0; i < param_group_num_; ++i) param_group_step_[i] = 0;
+		printf("group fea num:%ld\n",param_group_num_);
+	}
 
 	push_step_ = push_step;
 	fetch_step_ = fetch_step;
 
+	item_hits_.assign(MFSolver<T>::item_num_, 0);
+	hot_.assign(MFSolver<T>::item_num_, 0);
+	hot_rows_.clear();
+
+	user_grad_.assign(MFSolver<T>::l_dim_, 0);
+	item_grad_.assign(MFSolver<T>::l_dim_, 0);
+	neg_grad_.assign(MFSolver<T>::l_dim_, 0);
+
 	MFSolver<T>::init_ = true;
 	return MFSolver<T>::init_;
 }
@@ -244,6 +641,7 @@ bool MFWorker<T>::Initialize(
 template<typename T>
 bool MFWorker<T>::Reset(MFParamServer<T>* param_server) {
 	if (!MFSolver<T>::init_) return 0;
+	if (shared_rows_) return true;
 
 	param_server->FetchParam(MFSolver<T>::u_);
 
@@ -255,46 +653,217 @@ bool MFWorker<T>::Reset(MFParamServer<T>* param_server) {
 
 
 template<typename T>  
-T MFWorker<T>::Update(T& score,const std::vector<int>& x,MFParamServer<T>* param_server){
+typename MFWorker<T>::C MFWorker<T>::Update(C& score,const std::vector<mf_id_t>& x,MFParamServer<T>* param_server,size_t& trained){
 		if (x.size() < 2) // must contain userid and at least one item id
 		{
 			printf("size less than 2\n");
 			return 0.;
 		}
-		int user_key = x[0];
-		size_t g_group = user_key / kParamGroupSize;
-		if (user_key >= MFSolver<T>::user_num_) return 0.;
+		if (neg_sampler_) return UpdateBPR(x,param_server,trained);
+		if (param_server->dynamic_ids()) return UpdateDynamic(score,x,param_server,trained);
+		if (x[0] < 0 || static_cast<size_t>(x[0]) >= MFSolver<T>::user_num_) return 0.;
+		size_t user_key = static_cast<size_t>(x[0]);
+
+		T* user_row = user_owned_ ? param_server->row(user_key) : MFSolver<T>::u_[user_key];
+		T* user_delta = user_owned_ ? user_row : u_update_[user_key];
+		RowOptimizer<C>* opt = param_server->optimizer();
+		bool lazy = param_server->lazy_l2();
+		C l2 = lazy ? 0 : MFSolver<T>::l2_;
+		bool count_numa = node_ >= 0 && param_server->numa();
 
 		float rmse = 0.;
-        for( int j = 1;j < x.size();j++) {
+        for( size_t j = 1;j < x.size();j++) {
             size_t i = x[j] + MFSolver<T>::user_num_;
-			if (i >= MFSolver<T>::feat_num_) break;
-            size_t g = i / kParamGroupSize;
-            if (param_group_step_[g] % fetch_step_ == 0) 
-                param_server->FetchParamGroup(MFSolver<T>::u_,g);
-			if (param_group_step_[g_group] % fetch_step_ == 0) 
-				param_server->FetchParamGroup(MFSolver<T>::u_,g_group);
+			if (x[j] < 0 || i >= MFSolver<T>::feat_num_) break;
+			//shared rows have no private copy, the pair holds their locks while it uses them
+			OrderedLockGuard guard(shared_rows_ ? param_server->row_lock(user_key) : NULL,
+				shared_rows_ ? param_server->row_lock(i) : NULL);
+			if (IsHeldOut(user_key, x[j])) {
+				if (!user_owned_) FetchRowNow(user_key, param_server);
+				if (!(hot_num_ > 0 && hot_[x[j]])) FetchRowNow(i, param_server);
+				float err = -score;
+				for(int l = 0; l < MFSolver<T>::l_dim_;l++)
+					err += user_row[l] * MFSolver<T>::u_[i][l];
+				valid_loss_ += err * err;
+				++valid_count_;
+				continue;
+			}
+			++trained;
+			bool hot = IsHotItem(x[j]);
+			if (!hot) FetchRow(i,param_server);
+			if (!user_owned_) FetchRow(user_key,param_server);
+			if (lazy) {
+				DecayRow(user_key, user_row, user_delta, param_server);
+				DecayRow(i, MFSolver<T>::u_[i], u_update_[i], param_server);
+			}
+			if (count_numa) {
+				CountAccess(user_key, param_server);
+				CountAccess(i, param_server);
+			}
 			float ruv = 0.;
 			for(int l = 0; l < MFSolver<T>::l_dim_;l++)
-				ruv += MFSolver<T>::u_[user_key][l] * MFSolver<T>::u_[i][l];
+				ruv += user_row[l] * MFSolver<T>::u_[i][l];
 			float obj_grad = ruv - score;
 			rmse += obj_grad * obj_grad;
 			for(int l = 0; l < MFSolver<T>::l_dim_;l++){
-				u_update_[user_key][l] -= MFSolver<T>::alpha_ * (obj_grad * MFSolver<T>::u_[i][l]  + MFSolver<T>::l2_ * MFSolver<T>::u_[user_key][l]);
-				u_update_[i][l] -= MFSolver<T>::alpha_ * (obj_grad * MFSolver<T>::u_[user_key][l] + MFSolver<T>::l2_ * MFSolver<T>::u_[i][l]);
+				user_grad_[l] = obj_grad * MFSolver<T>::u_[i][l]  + l2 * user_row[l];
+				item_grad_[l] = obj_grad * user_row[l] + l2 * MFSolver<T>::u_[i][l];
+			}
+			C user_rate = MFSolver<T>::alpha_ * opt->Rate(user_key, &user_grad_[0]);
+			C item_rate = MFSolver<T>::alpha_ * opt->Rate(i, &item_grad_[0]);
+			for(int l = 0; l < MFSolver<T>::l_dim_;l++){
+				C user_step = user_rate * user_grad_[l];
+				C item_step = item_rate * item_grad_[l];
+				user_delta[l] -= user_step;
+				u_update_[i][l] -= item_step;
+				//hot replicas are not refetched per update, so they must track their own steps
+				if (hot) MFSolver<T>::u_[i][l] -= item_step;
 			}
 
 			//update
-			if (param_group_step_[g_group] % push_step_ == 0)
-				param_server->PushParamGroup(u_update_,g_group);
-			if (param_group_step_[g] % push_step_ == 0) 
-				param_server->PushParamGroup(u_update_,g);
-			param_group_step_[g_group] += 1;	
-			param_group_step_[g] += 1;	
+			if (!user_owned_) PushRow(user_key,param_server);
+			if (!hot) PushRow(i,param_server);
     	}
-		return rmse / (x.size() - 1);
+		return rmse;
 }
 
+template<typename T>  
+typename MFWorker<T>::C MFWorker<T>::UpdateBPR(const std::vector<mf_id_t>& x,MFParamServer<T>* param_server,size_t& trained){
+		if (x[0] < 0 || static_cast<size_t>(x[0]) >= MFSolver<T>::user_num_) return 0.;
+		size_t user_key = static_cast<size_t>(x[0]);
+
+		T* user_row = user_owned_ ? param_server->row(user_key) : MFSolver<T>::u_[user_key];
+		T* user_delta = user_owned_ ? user_row : u_update_[user_key];
+		T** u = MFSolver<T>::u_;
+		RowOptimizer<C>* opt = param_server->optimizer();
+		bool lazy = param_server->lazy_l2();
+		C l2 = lazy ? 0 : MFSolver<T>::l2_;
+		bool count_numa = node_ >= 0 && param_server->numa();
+
+		float loss = 0.;
+		for (size_t j = 1;j < x.size();j++) {
+			size_t i = x[j] + MFSolver<T>::user_num_;
+			if (x[j] < 0 || i >= MFSolver<T>::feat_num_) break;
+			//held out positives are scored too, so a negative equal to the positive is redrawn
+			bool held_out = IsHeldOut(user_key, x[j]);
+			size_t k = SampleNegative(i);
+			if (k >= MFSolver<T>::feat_num_) continue;
+			OrderedLockGuard guard(shared_rows_ ? param_server->row_lock(user_key) : NULL,
+				shared_rows_ ? param_server->row_lock(i) : NULL, shared_rows_ ? param_server->row_lock(k) : NULL);
+			if (held_out) {
+				if (!user_owned_) FetchRowNow(user_key, param_server);
+				if (!(hot_num_ > 0 && hot_[x[j]])) FetchRowNow(i, param_server);
+				if (!(hot_num_ > 0 && hot_[k - MFSolver<T>::user_num_])) FetchRowNow(k, param_server);
+				float x_uik = 0.;
+				for (int l = 0; l < MFSolver<T>::l_dim_;l++)
+					x_uik += user_row[l] * (u[i][l] - u[k][l]);
+				valid_loss_ += sigmoid(-x_uik);
+				++valid_count_;
+				continue;
+			}
+
+			bool hot_i = IsHotItem(x[j]);
+			bool hot_k = hot_num_ > 0 && hot_[k - MFSolver<T>::user_num_];
+			if (!hot_i) FetchRow(i,param_server);
+			if (!hot_k) FetchRow(k,param_server);
+			if (!user_owned_) FetchRow(user_key,param_server);
+			if (lazy) {
+				DecayRow(user_key, user_row, user_delta, param_server);
+				DecayRow(i, u[i], u_update_[i], param_server);
+				DecayRow(k, u[k], u_update_[k], param_server);
+			}
+			if (count_numa) {
+				CountAccess(user_key, param_server);
+				CountAccess(i, param_server);
+				CountAccess(k, param_server);
+			}
+
+			float x_uik = 0.;
+			for (int l = 0; l < MFSolver<T>::l_dim_;l++)
+				x_uik += user_row[l] * (u[i][l] - u[k][l]);
+			//d(-ln sigmoid(x_uik)) / d x_uik = -sigmoid(-x_uik)
+			float g = sigmoid(-x_uik);
+			loss += g;
+			++trained;
+			//ascent directions of ln sigmoid(x_uik)
+			for (int l = 0; l < MFSolver<T>::l_dim_;l++) {
+				C ul = user_row[l];
+				user_grad_[l] = g * (u[i][l] - u[k][l]) - l2 * ul;
+				item_grad_[l] = g * ul - l2 * u[i][l];
+				neg_grad_[l] = -g * ul - l2 * u[k][l];
+			}
+			C user_rate = MFSolver<T>::alpha_ * opt->Rate(user_key, &user_grad_[0]);
+			C pos_rate = MFSolver<T>::alpha_ * opt->Rate(i, &item_grad_[0]);
+			C neg_rate = MFSolver<T>::alpha_ * opt->Rate(k, &neg_grad_[0]);
+			for (int l = 0; l < MFSolver<T>::l_dim_;l++) {
+				C user_step = user_rate * user_grad_[l];
+				C pos_step = pos_rate * item_grad_[l];
+				C neg_step = neg_rate * neg_grad_[l];
+				user_delta[l] += user_step;
+				u_update_[i][l] += pos_step;
+				u_update_[k][l] += neg_step;
+				if (hot_i) u[i][l] += pos_step;
+				if (hot_k) u[k][l] += neg_step;
+			}
+
+			if (!user_owned_) PushRow(user_key,param_server);
+			if (!hot_i) PushRow(i,param_server);
+			if (!hot_k) PushRow(k,param_server);
+		}
+		//summed probability of ranking the negative above the positive
+		return loss;
+}
+
+template<typename T>  
+typename MFWorker<T>::C MFWorker<T>::UpdateDynamic(C& score,const std::vector<mf_id_t>& x,MFParamServer<T>* param_server,size_t& trained){
+		if (x[0] < 0) return 0.;
+		const uint64_t user_id = static_cast<uint64_t>(x[0]);
+		const uint64_t kNoRow = ConcurrentRowMap::kNoRow;
+		//created on the first trained pair, ids seen only in held out pairs get no row
+		uint64_t user = kNoRow;
+		const int l_dim = MFSolver<T>::l_dim_;
+		C alpha = MFSolver<T>::alpha_;
+		C l2 = MFSolver<T>::l2_;
+
+		float rmse = 0.;
+		for (size_t j = 1; j < x.size(); j++) {
+			if (x[j] < 0) break;
+			const uint64_t item_id = static_cast<uint64_t>(x[j]);
+			if (IsHeldOut(x[0], x[j])) {
+				uint64_t u_index = user != kNoRow ? user : param_server->FindUserIndex(user_id);
+				uint64_t v_index = param_server->FindItemIndex(item_id);
+				if (u_index == kNoRow || v_index == kNoRow) continue;
+				OrderedLockGuard guard(param_server->dynamic_lock(u_index), param_server->dynamic_lock(v_index));
+				const T* u = param_server->dynamic_row(u_index);
+				const T* v = param_server->dynamic_row(v_index);
+				float err = -score;
+				for (int l = 0; l < l_dim; l++)
+					err += u[l] * v[l];
+				valid_loss_ += err * err;
+				++valid_count_;
+				continue;
+			}
+			if (user == kNoRow) user = param_server->UserIndex(user_id);
+			uint64_t item = param_server->ItemIndex(item_id);
+			//rows are shared by all workers, each pair updates them under their locks
+			OrderedLockGuard guard(param_server->dynamic_lock(user), param_server->dynamic_lock(item));
+			T* user_row = param_server->dynamic_row(user);
+			T* item_row = param_server->dynamic_row(item);
+			float ruv = 0.;
+			for (int l = 0; l < l_dim; l++)
+				ruv += user_row[l] * item_row[l];
+			float obj_grad = ruv - score;
+			++trained;
+			rmse += obj_grad * obj_grad;
+			for (int l = 0; l < l_dim; l++) {
+				C ul = user_row[l];
+				C il = item_row[l];
+				user_row[l] -= alpha * (obj_grad * il + l2 * ul);
+				item_row[l] -= alpha * (obj_grad * ul + l2 * il);
+			}
+		}
+		return rmse;
+}
 
 template<typename T>
 bool MFWorker<T>::PushParam(MFParamServer<T>* param_server) {
@@ -307,6 +876,44 @@ bool MFWorker<T>::PushParam(MFParamServer<T>* param_server) {
 	return true;
 }
 
+template<typename T>
+bool MFWorker<T>::MergeHotRows(MFParamServer<T>* param_server) {
+	if (!MFSolver<T>::init_) return false;
+
+	for (size_t k = 0; k < hot_rows_.size(); ++k) {
+		size_t g = hot_rows_[k] / kParamGroupSize;
+		param_server->PushParamGroup(u_update_,g);
+		param_server->FetchParamGroup(MFSolver<T>::u_,g);
+	}
+	return true;
+}
+
+//pick the hot_num_ items this worker hit most often, by counts halved at every refresh, as its hot set
+template<typename T>
+bool MFWorker<T>::RefreshHotRows(MFParamServer<T>* param_server) {
+	if (!MFSolver<T>::init_ || hot_num_ == 0 || shared_rows_) return false;
+
+	MergeHotRows(param_server);
+	for (size_t k = 0; k < hot_rows_.size(); ++k)
+		hot_[hot_rows_[k] - MFSolver<T>::user_num_] = 0;
+	hot_rows_.clear();
+
+	std::vector<size_t> items;
+	for (size_t k = 0; k < item_hits_.size(); ++k) {
+		if (item_hits_[k] > 0) items.push_back(k);
+	}
+	size_t n = std::min(hot_num_, items.size());
+	std::nth_element(items.begin(), items.begin() + n, items.end(),
+		[this] (size_t a, size_t b) { return item_hits_[a] > item_hits_[b]; });
+
+	for (size_t k = 0; k < n; ++k) {
+		hot_[items[k]] = 1;
+		hot_rows_.push_back(items[k] + MFSolver<T>::user_num_);
+	}
+	//age the counts, the next hot set weighs recent hits most and follows drift
+	for (size_t k = 0; k < item_hits_.size(); ++k) item_hits_[k] >>= 1;
+	return true;
+}
 
 #endif // SRC_FAST_MF_SOLVER_H
 /* vim: set ts=4 sw=4 tw=0 noet :*/
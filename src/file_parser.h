@@ -21,6 +21,8 @@
 #ifndef SRC_FILE_PARSER_H
 #define SRC_FILE_PARSER_H
 
+#include <cerrno>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -32,6 +34,9 @@
 #include "hdfs.h"
 #include "src/lock.h"
 #include <climits>
+
+//user and item ids as parsed, malformed or out of range ids become -1
+typedef int64_t mf_id_t;
 const int buf_in_out_expand = 1;
 
 template<typename T>
@@ -45,8 +50,8 @@ public:
 	virtual bool OpenNextFile() = 0;
 	virtual bool CloseFile() = 0;
 
-	virtual bool ReadSample(T& score, std::vector<int>& x) = 0;
-	virtual bool ReadSampleMultiThread(T& score,std::vector<int>& x) = 0 ;
+	virtual bool ReadSample(T& score, std::vector<mf_id_t>& x) = 0;
+	virtual bool ReadSampleMultiThread(T& score,std::vector<mf_id_t>& x) = 0 ;
 
 public:
 	static bool FileExists(const char* path);
@@ -65,18 +70,18 @@ public:
 	FILE* HdfsOpen(const char* path);
 
 	// Read a new line and Parse to <x, y>, thread-safe but not optimized for multi-threading
-	virtual bool ReadSample(T& score, std::vector<int>& x);
+	virtual bool ReadSample(T& score, std::vector<mf_id_t>& x);
 	// Read a new line and Parse to <x, y>, with multi-threading capability
-	virtual bool ReadSampleMultiThread(T& score,std::vector<int>& x);
+	virtual bool ReadSampleMultiThread(T& score,std::vector<mf_id_t>& x);
 
 	bool ParseSample(char* buf, T& y,
 		std::vector<std::pair<size_t, T> >& x);
 	//add 16.04.18
 	bool ParseSample(char* buf, T& score,
-		std::vector<int>& x);
+		std::vector<mf_id_t>& x);
 
     //function to parse user title click file format for maxtrix factorization
-	bool ParseSampleMF(char* buf, std::vector<int>& x);
+	bool ParseSampleMF(char* buf, std::vector<mf_id_t>& x);
 
 	// Read a new line using external buffer
 	char* ReadLine(char *buf, size_t& buf_size);
@@ -541,7 +546,7 @@ double string_to_real<double> (const char *nptr, char **endptr) {
 
 
 template<typename T>
-bool FileParser<T>::ReadSampleMultiThread(T& score,std::vector<int>& x) {
+bool FileParser<T>::ReadSampleMultiThread(T& score,std::vector<mf_id_t>& x) {
 	std::lock_guard<SpinLock> lock(lock_);
 	char *buf = (this->*ReadLineImpl)(buf_, buf_size_);
 	if (!buf) {
@@ -552,7 +557,7 @@ bool FileParser<T>::ReadSampleMultiThread(T& score,std::vector<int>& x) {
 }
 
 template<typename T>
-bool FileParser<T>::ReadSample(T& score,std::vector<int>& x) {
+bool FileParser<T>::ReadSample(T& score,std::vector<mf_id_t>& x) {
 	std::lock_guard<SpinLock> lock(lock_);
 	char *buf = (this->*ReadLineImpl)(buf_, buf_size_);
 	if (!buf) {
@@ -564,7 +569,7 @@ bool FileParser<T>::ReadSample(T& score,std::vector<int>& x) {
 
 template<typename T>
 bool FileParser<T>::ParseSample(char* buf, T& score,
-		std::vector<int>& x) {
+		std::vector<mf_id_t>& x) {
 	x.clear();
 	if (buf == NULL) return false;
 	char *endptr, *ptr;
@@ -572,7 +577,9 @@ bool FileParser<T>::ParseSample(char* buf, T& score,
 
 	if (cl == NULL) return false;
 
-	int user_key = (size_t) strtol(cl, &endptr, 10);
+	errno = 0;
+	mf_id_t user_key = strtoll(cl, &endptr, 10);
+	if (endptr == cl || errno == ERANGE || user_key < 0) user_key = -1;
 	x.push_back(user_key);
 
 	char *im = strtok_r(NULL, " \t\n", &ptr);
@@ -586,15 +593,10 @@ bool FileParser<T>::ParseSample(char* buf, T& score,
 		char *idx = strtok_r(NULL, " \t", &ptr);
 		if (idx == NULL) break;
 
-		bool error_found = false;
-		size_t k = (size_t) strtol(idx, &endptr, 10);
-
-		if (endptr == idx || *endptr != '\0' || static_cast<int>(k) < 0) {
-			error_found = true;
-		}
-		//if (!error_found) {
-			x.push_back(k);
-		//}
+		errno = 0;
+		mf_id_t k = strtoll(idx, &endptr, 10);
+		if (endptr == idx || errno == ERANGE || k < 0) k = -1;
+		x.push_back(k);
     }
 	return true;
 }
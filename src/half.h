@@ -0,0 +1,89 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_HALF_H
+#define SRC_HALF_H
+
+#include <cstdint>
+#include <cstring>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+//ieee 754 binary16 <-> binary32, round to nearest even
+inline uint16_t float_to_half(float f) {
+#ifdef __F16C__
+	return _cvtss_sh(f, 0);
+#else
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	uint32_t sign = (x >> 16) & 0x8000;
+	uint32_t abs = x & 0x7fffffff;
+	if (abs >= 0x7f800000) //inf or nan
+		return static_cast<uint16_t>(sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0));
+	if (abs >= 0x477ff000) //overflows to inf
+		return static_cast<uint16_t>(sign | 0x7c00);
+	if (abs < 0x38800000) { //subnormal or zero
+		if (abs < 0x33000000) return static_cast<uint16_t>(sign);
+		uint32_t mant = (abs & 0x7fffff) | 0x800000;
+		int shift = 126 - static_cast<int>(abs >> 23);
+		uint32_t h = mant >> shift;
+		uint32_t rem = mant & ((1u << shift) - 1);
+		uint32_t half = 1u << (shift - 1);
+		if (rem > half || (rem == half && (h & 1))) ++h;
+		return static_cast<uint16_t>(sign | h);
+	}
+	uint32_t h = ((abs - 0x38000000) >> 13);
+	uint32_t rem = abs & 0x1fff;
+	if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) ++h;
+	return static_cast<uint16_t>(sign | h);
+#endif
+}
+
+inline float half_to_float(uint16_t h) {
+#ifdef __F16C__
+	return _cvtsh_ss(h);
+#else
+	uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+	uint32_t exp = (h >> 10) & 0x1f;
+	uint32_t mant = h & 0x3ff;
+	uint32_t x;
+	if (exp == 0x1f) {
+		x = sign | 0x7f800000 | (mant << 13);
+	} else if (exp != 0) {
+		x = sign | ((exp + 112) << 23) | (mant << 13);
+	} else if (mant == 0) {
+		x = sign;
+	} else { //subnormal
+		exp = 113;
+		while (!(mant & 0x400)) {
+			mant <<= 1;
+			--exp;
+		}
+		x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+	}
+	float f;
+	memcpy(&f, &x, sizeof(f));
+	return f;
+#endif
+}
+
+#endif // SRC_HALF_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
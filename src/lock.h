@@ -21,7 +21,9 @@
 #ifndef SRC_LOCK_H
 #define SRC_LOCK_H
 
+#include <algorithm>
 #include <atomic>
+#include <functional>
 #include <mutex>
 
 class SpinLock {
@@ -43,5 +45,29 @@ protected:
 	std::atomic_flag flag_;
 };
 
+//holds up to three locks, NULL ones are skipped and one listed twice is taken once.
+//they are taken in address order, so two guards over the same locks never deadlock
+class OrderedLockGuard {
+public:
+	OrderedLockGuard(SpinLock* a, SpinLock* b, SpinLock* c = NULL) : n_(0) {
+		SpinLock* locks[3] = {a, b, c};
+		std::sort(locks, locks + 3, std::less<SpinLock*>());
+		for (int k = 0; k < 3; ++k) {
+			if (locks[k] != NULL && (n_ == 0 || locks_[n_ - 1] != locks[k])) locks_[n_++] = locks[k];
+		}
+		for (int k = 0; k < n_; ++k) locks_[k]->lock();
+	}
+	~OrderedLockGuard() {
+		for (int k = n_ - 1; k >= 0; --k) locks_[k]->unlock();
+	}
+
+private:
+	OrderedLockGuard(const OrderedLockGuard&);
+	OrderedLockGuard& operator=(const OrderedLockGuard&);
+
+	SpinLock* locks_[3];
+	int n_;
+};
+
 #endif // SRC_LOCK_H
 /* vim: set ts=4 sw=4 tw=0 noet :*/
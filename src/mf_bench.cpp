@@ -0,0 +1,123 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <getopt.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include "src/fast_mf_solver.h"
+#include "src/stopwatch.h"
+#include "src/util.h"
+
+//update rate of the sgd worker on a synthetic model with uniformly random rows, so
+//nearly every row access misses the tlb, once on normal pages and once on huge pages.
+//both runs keep each matrix in one mapping, so only the page size differs
+
+void print_usage() {
+	printf("Usage: ./mf_bench [options]\n"
+		"options:\n"
+		"-u num : user rows, default 4000000\n"
+		"-i num : item rows, default 1000000\n"
+		"-d dim : latent dimension, default 32\n"
+		"-n num : updates per thread, default 2000000\n"
+		"-t num : threads, default 2\n"
+		"-h : print this help\n"
+	);
+}
+
+double bench(bool huge, size_t user_num, size_t item_num, int dim,
+		const std::vector<std::vector<std::vector<mf_id_t> > >& lines) {
+	huge_pages_enabled() = huge;
+	normal_pages_arena() = !huge;
+	size_t num_threads = lines.size();
+
+	MFParamServer<float> param_server;
+	param_server.SetInitThreads(num_threads);
+	param_server.Initialize(0.01f, 0.01f, user_num, item_num, dim);
+	MFWorker<float>* workers = new MFWorker<float>[num_threads];
+	auto init_func = [&] (size_t i) { workers[i].Initialize(&param_server); };
+	util_parallel_run(init_func, num_threads);
+
+	StopWatch timer;
+	auto worker_func = [&] (size_t i) {
+		float score = 1.f;
+		size_t trained = 0;
+		for (size_t j = 0; j < lines[i].size(); ++j)
+			workers[i].Update(score, lines[i][j], &param_server, trained);
+	};
+	util_parallel_run(worker_func, num_threads);
+	double elapsed = timer.StopTimer();
+
+	delete [] workers;
+	return elapsed;
+}
+
+int main(int argc, char* argv[]) {
+	size_t user_num = 4000000, item_num = 1000000, updates = 2000000, num_threads = 2;
+	int dim = 32;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "u:i:d:n:t:h")) != -1) {
+		switch (opt) {
+		case 'u':
+			user_num = (size_t)atol(optarg);
+			break;
+		case 'i':
+			item_num = (size_t)atol(optarg);
+			break;
+		case 'd':
+			dim = atoi(optarg);
+			break;
+		case 'n':
+			updates = (size_t)atol(optarg);
+			break;
+		case 't':
+			num_threads = std::max(1, atoi(optarg));
+			break;
+		case 'h':
+		default:
+			print_usage();
+			exit(0);
+		}
+	}
+
+	std::vector<std::vector<std::vector<mf_id_t> > > lines(num_threads);
+	for (size_t i = 0; i < num_threads; ++i) {
+		std::mt19937_64 rng(i + 1);
+		lines[i].resize(updates, std::vector<mf_id_t>(2));
+		for (size_t j = 0; j < updates; ++j) {
+			lines[i][j][0] = static_cast<mf_id_t>(rng() % user_num);
+			lines[i][j][1] = static_cast<mf_id_t>(rng() % item_num);
+		}
+	}
+
+	double normal = bench(false, user_num, item_num, dim, lines);
+	double huge = bench(true, user_num, item_num, dim, lines);
+	double total = static_cast<double>(updates) * num_threads;
+	printf("users=%zu items=%zu dim=%d threads=%zu updates=%.0f\n",
+		user_num, item_num, dim, num_threads, total);
+	printf("normal pages: %.3fs, %.0f updates/s\n", normal, total / normal);
+	printf("huge pages:   %.3fs, %.0f updates/s, speedup %.2fx\n", huge, total / huge, normal / huge);
+	return 0;
+}
+/* vim: set ts=4 sw=4 tw=0 noet :*/
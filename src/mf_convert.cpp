@@ -0,0 +1,140 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <unistd.h>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "src/model_io.h"
+
+//converts models between the text and the binary format, and between element types
+
+void print_usage(int argc, char* argv[]) {
+	printf("Usage:\n");
+	printf("\t%s -i input_model -o output_model [-f text|binary] [-d fp32|fp64|bf16|fp16] [-n threads]\n", argv[0]);
+	printf("\t-f : output format, default the other format than the input's\n");
+	printf("\t-d : binary output element type, default the input's, fp32 for text input\n");
+	printf("\t-n : threads reading and writing models, default 0 uses every cpu\n");
+}
+
+//load input into rows of T and save them as output
+template<typename T>
+bool convert(const char* input, const char* output, bool binary_out, size_t num_threads) {
+	size_t user_num = 0, item_num = 0;
+	int l_dim = 0;
+	std::vector<T> data;
+	BinaryModelHeader header;
+	if (read_binary_model_header(input, header)) {
+		user_num = header.user_num;
+		item_num = header.item_num;
+		l_dim = header.l_dim;
+		data.resize(header.rows() * l_dim);
+		T* base = data.data();
+		auto row = [base, l_dim] (size_t i) -> T* { return base + i * l_dim; };
+		if (!read_binary_model<T>(input, header, row, num_threads)) return false;
+	} else {
+		//text elements are parsed as double: float and double round once, bf16 and fp16
+		//convert through float and may round twice, a last ulp off the nearest value
+		std::vector<double> text;
+		if (!read_text_model(input, user_num, item_num, l_dim, text)) {
+			printf("read model %s failed\n", input);
+			return false;
+		}
+		data.resize(text.size());
+		for (size_t k = 0; k < text.size(); ++k) data[k] = static_cast<T>(text[k]);
+	}
+
+	const T* base = data.data();
+	auto row = [base, l_dim] (size_t i) -> const T* { return base + i * l_dim; };
+	printf("%zu users, %zu items, dim %d\n", user_num, item_num, l_dim);
+	if (binary_out) return write_binary_model<T>(output, user_num, item_num, l_dim, row, num_threads);
+	return write_text_model<T>(output, user_num, item_num, l_dim, row, num_threads);
+}
+
+int main(int argc, char* argv[]) {
+	int ch;
+
+	std::string input;
+	std::string output;
+	std::string format;
+	std::string dtype_name;
+	size_t num_threads = 0;
+
+	while ((ch = getopt(argc, argv, "i:o:f:d:n:h")) != -1) {
+		switch (ch) {
+		case 'i':
+			input = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'f':
+			format = optarg;
+			break;
+		case 'd':
+			dtype_name = optarg;
+			break;
+		case 'n':
+			num_threads = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			print_usage(argc, argv);
+			exit(0);
+		}
+	}
+
+	if (input.size() == 0 || output.size() == 0) {
+		print_usage(argc, argv);
+		exit(1);
+	}
+
+	BinaryModelHeader header;
+	bool binary_in = read_binary_model_header(input.c_str(), header);
+	if (!binary_in && is_binary_model(input.c_str())) exit(1);
+	if (format.empty()) format = binary_in ? "text" : "binary";
+	if (format != "text" && format != "binary") {
+		printf("unknown format %s\n", format.c_str());
+		exit(1);
+	}
+
+	uint32_t dtype = binary_in ? header.dtype : static_cast<uint32_t>(kModelFp32);
+	if (!dtype_name.empty() && !parse_model_dtype(dtype_name, dtype)) {
+		printf("unknown element type %s\n", dtype_name.c_str());
+		exit(1);
+	}
+
+	bool binary_out = format == "binary";
+	bool ok = false;
+	switch (dtype) {
+	case kModelFp64: ok = convert<double>(input.c_str(), output.c_str(), binary_out, num_threads); break;
+	case kModelBf16: ok = convert<bf16>(input.c_str(), output.c_str(), binary_out, num_threads); break;
+	case kModelFp16: ok = convert<fp16>(input.c_str(), output.c_str(), binary_out, num_threads); break;
+	default: ok = convert<float>(input.c_str(), output.c_str(), binary_out, num_threads); break;
+	}
+	if (!ok) {
+		printf("convert %s to %s failed\n", input.c_str(), output.c_str());
+		exit(1);
+	}
+	printf("wrote %s model %s, %s\n", format.c_str(), output.c_str(), model_dtype_name(dtype));
+	return 0;
+}
+/* vim: set ts=4 sw=4 tw=0 noet :*/
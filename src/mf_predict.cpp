@@ -29,15 +29,16 @@
 void print_usage(int argc, char* argv[]) {
 	printf("Usage:\n");
 	printf("\t%s -t test_file -m model \n", argv[0]);
+	printf("\ta binary model is mapped and read in place, see mf_convert\n");
 }
 template<typename T>
 bool LoadBatchSamples(FileParser<T>& file_parser,
           std::vector<T>& train_samples_scores,
-          std::vector<std::vector<int> >& train_samples,
+          std::vector<std::vector<mf_id_t> >& train_samples,
           int batch_size){
 	int cnt = 0;
 	T score = 0.;
-	std::vector<int> x;
+	std::vector<mf_id_t> x;
 	while (file_parser.ReadSample(score,x)) {
 		train_samples.push_back(x);
 		train_samples_scores.push_back(score);
@@ -77,7 +78,10 @@ int main(int argc, char* argv[]) {
 	}
 
 	MFModel<double> model;
-	model.Initialize(model_file.c_str());
+	if (!model.Initialize(model_file.c_str())) {
+		printf("load model %s failed\n", model_file.c_str());
+		exit(1);
+	}
 
 	int num_threads = 8;
 	
@@ -102,13 +106,13 @@ int main(int argc, char* argv[]) {
 		parser.OpenFile(split_train_list[i].c_str());
 
 		size_t local_count = 0;
-		std::vector<std::vector<int> > train_samples;
+		std::vector<std::vector<mf_id_t> > train_samples;
 		std::vector<double> train_samples_scores;
 		while (LoadBatchSamples<double>(parser,train_samples_scores,train_samples,batch_size)){
 			double local_rmse = 0.;
 			double score = 0.;
 			for( size_t j = 0; j < train_samples.size();j++){
-				std::vector<int>& tx = train_samples[j];
+				std::vector<mf_id_t>& tx = train_samples[j];
 				score = train_samples_scores[j];
 				local_rmse += model.Predict(score,tx);
 			}
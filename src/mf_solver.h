@@ -25,6 +25,7 @@
 #include <cstdlib>
 #include <fstream>
 #include <strstream>
+#include <thread>
 #include <functional>
 #include <iomanip>
 #include <limits>
@@ -35,6 +36,11 @@
 #include <set>
 #include <map>
 #include <unordered_map>
+#include "src/arena.h"
+#include "src/file_parser.h"
+#include "src/model_io.h"
+#include "src/philox.h"
+#include "src/reduced_float.h"
 #include "src/util.h"
 
 #define DEFAULT_ALPHA 0.01
@@ -44,28 +50,55 @@
 const double rand_val = 0.1;
 int dim = 20;
 
+//T is the storage type of the factors, float, double or a 16 bit bf16 / fp16
+//whose arithmetic runs in compute_type<T>::type
 template<typename T>
 class MFSolver {
 	public:
+	typedef typename compute_type<T>::type C;
+
 	MFSolver();
 
 	virtual ~MFSolver();
 
 	virtual bool Initialize(
-		T alpha,T l2, size_t user_num,size_t item_num,int latent_dim);
+		C alpha,C l2, size_t user_num,size_t item_num,int latent_dim);
 
+	//initialize to the counts and dim of the text or binary model at path and load its rows
 	virtual bool Initialize(const char* path);
+	//warm start: overwrite the rows of an initialized solver with those of the model at path.
+	//rows are matched by user and item id, so a model saved before the id ranges grew fills
+	//the rows it has and the new ones keep their random init. the dims must agree
+	virtual bool LoadModel(const char* path);
 
 	virtual bool SaveModelAll(const char* path);
 	virtual bool SaveModel(const char* path);
 	virtual bool SaveModelDetail(const char* path);
 
 	public:
-	T alpha() { return alpha_; }
-	T l2() { return l2_; }
+	C alpha() { return alpha_; }
+	C l2() { return l2_; }
 	int  l_dim() { return l_dim_; }
 	size_t feat_num() { return feat_num_; }
 	size_t user_num() { return user_num_; }
+	size_t item_num() { return item_num_; }
+	T* row(size_t i) { return u_[i]; }
+	T** rows() { return u_; }
+	//rows are first touched round robin by this many pool threads, 0 uses every cpu
+	void SetInitThreads(size_t init_threads) { init_threads_ = init_threads; }
+	//keep the matrix in a file mapping at path instead of memory, set before Initialize
+	void SetStoreFile(const std::string& path) { store_path_ = path; }
+	bool out_of_core() const { return store_ != NULL; }
+	//save the binary format of model_io.h instead of text
+	void SetBinaryModel(bool binary) { binary_model_ = binary; }
+	bool binary_model() const { return binary_model_; }
+	//residency hints for rows [begin, end) of the file store, no-ops in memory
+	void PrefetchRows(size_t begin, size_t end) {
+		if (store_ && begin < end) store_->Prefetch(u_[begin], (end - begin) * l_dim_ * sizeof(T));
+	}
+	void EvictRows(size_t begin, size_t end) {
+		if (store_ && begin < end) store_->Evict(u_[begin], (end - begin) * l_dim_ * sizeof(T));
+	}
 
 	protected:
 	enum {kPrecision = 8};
@@ -73,11 +106,23 @@ class MFSolver {
 	protected:
 	T GetWeight(size_t row,size_t col);
 	T GetWeightSave(size_t row,size_t col);
+    //val 0 zeroes the rows, otherwise fills them uniform on [0, sqrt(1 / l_dim)).
+    //row i is allocated and filled on pool thread i % init_threads_, element (i, j) is drawn from
+    //the philox stream at counter (i, j / 4), the same for any thread count
     void set_float_rand(T** x, size_t n,const int l_dim, T val);
+    //fill row i of width l_dim as set_float_rand does
+    void fill_row_rand(T* x, size_t i, const int l_dim, T val);
+    //with huge pages enabled, an untouched block of n elements from a new arena of
+    //this solver, NULL otherwise. arena memory is released with the solver
+    T* AllocArenaBlock(size_t n);
+    //point the n rows of x into one arena block, false when huge pages are off
+    bool AllocArenaRows(T** x, size_t n, const int l_dim);
+    //point the n rows of x into a new file store at store_path_, false when it can't be mapped
+    bool AllocStoreRows(T** x, size_t n, const int l_dim);
 
 	protected:
-	T alpha_;
-	T l2_;
+	C alpha_;
+	C l2_;
 	size_t feat_num_;
 	size_t user_num_;
 	size_t item_num_;
@@ -89,27 +134,68 @@ class MFSolver {
 
 	bool init_;
 
-	std::mt19937 rand_generator_;
-	std::uniform_real_distribution<T> uniform_dist_;
+	size_t init_threads_;
+	std::vector<FactorArena*> arenas_;
+	bool arena_rows_;	//the rows of u_ point into an arena or the store, they are not freed one by one
+	std::string store_path_;
+	FactorArena* store_;	//also in arenas_
+	bool binary_model_;
 };
 
 
 
 template<typename T>
 MFSolver<T>::MFSolver()
-: alpha_(0), l2_(0), feat_num_(0),u_(NULL),init_(false),user_num_(0),item_num_(0),
-uniform_dist_(0.0, std::nextafter(1.0, std::numeric_limits<T>::max())) {}
+: alpha_(0), l2_(0), feat_num_(0),u_(NULL),init_(false),user_num_(0),item_num_(0),init_threads_(0),arena_rows_(false),store_(NULL),binary_model_(false) {}
 
 template<typename T>
 MFSolver<T>::~MFSolver() {
     if (u_){
-	    for (size_t i = 0; i < feat_num_; ++i) 
+	    for (size_t i = 0; i < feat_num_ && !arena_rows_; ++i) 
         {
             if (u_[i] )
                 delete [] u_[i];
         }
         delete [] u_;
     }
+	for (size_t k = 0; k < arenas_.size(); ++k) delete arenas_[k];
+}
+
+template<typename T>
+T* MFSolver<T>::AllocArenaBlock(size_t n) {
+	if (!factor_arena_enabled()) return NULL;
+	FactorArena* arena = new FactorArena();
+	if (!arena->Map(std::max<size_t>(1, n) * sizeof(T))) {
+		delete arena;
+		return NULL;
+	}
+	arenas_.push_back(arena);
+	printf("factor arena %.1f MB on %s pages\n", arena->bytes() / 1048576., arena->kind());
+	return static_cast<T*>(arena->base());
+}
+
+template<typename T>
+bool MFSolver<T>::AllocArenaRows(T** x, size_t n, const int l_dim) {
+	T* block = AllocArenaBlock(n * l_dim);
+	if (block == NULL) return false;
+	for (size_t i = 0; i < n; ++i) x[i] = block + i * l_dim;
+	return true;
+}
+
+template<typename T>
+bool MFSolver<T>::AllocStoreRows(T** x, size_t n, const int l_dim) {
+	FactorArena* store = new FactorArena();
+	if (!store->MapFile(store_path_.c_str(), std::max<size_t>(1, n * l_dim) * sizeof(T))) {
+		printf("map store file %s failed\n", store_path_.c_str());
+		delete store;
+		return false;
+	}
+	arenas_.push_back(store);
+	store_ = store;
+	printf("factor store %.1f MB in %s\n", store->bytes() / 1048576., store_path_.c_str());
+	T* block = static_cast<T*>(store->base());
+	for (size_t i = 0; i < n; ++i) x[i] = block + i * l_dim;
+	return true;
 }
 
 template<typename T>
@@ -119,35 +205,34 @@ void set_float_zero(T* x, size_t n) {
 	}
 }
 
+template<typename T>
+void MFSolver<T>::fill_row_rand(T* x, size_t i, const int l_dim_, T val){
+	const uint64_t kInitKey = 0x5eed;
+	if (val == 0.0) {
+		std::fill(x, x + l_dim_, static_cast<T>(0));
+		return;
+	}
+	float scale = sqrt(1.0/l_dim_);//lib_mf method
+	for (int j = 0; j < l_dim_; j += 4) {
+		Philox4x32 r(i, j >> 2, kInitKey);
+		for (int k = 0; k < 4 && j + k < l_dim_; ++k)
+			x[j + k] = Philox4x32::to_unit(r.v[k]) * scale;
+	}
+}
+
 template<typename T>
 void MFSolver<T>::set_float_rand(T** x, size_t n,const int l_dim_, T val){
-    if (val == 0.0)
-     {
-        for (size_t i = 0; i < n; ++i) {
-            for (size_t j = 0; j < l_dim_; ++j) {
-                x[i][j] = 0.0;
-            }
-        }
-         return;
-     }
-     std::random_device rd;
-     std::mt19937 gen(rd());
-     std::default_random_engine generator;
-     //std::normal_distribution<T> distribution(0,rand_val);
-
-	 float scale = sqrt(1.0/l_dim_);//lib_mf method
-     std::uniform_real_distribution<> distribution(0,1.);
-	for (size_t i = 0; i < n; ++i) {
-	    for (size_t j = 0; j < l_dim_; ++j) {
-            x[i][j] = distribution(generator) * scale;
-	    }
-    }
+	auto fill_row = [&] (size_t i) {
+		if (x[i] == NULL) x[i] = new T[l_dim_];
+		fill_row_rand(x[i], i, l_dim_, val);
+	};
+	util_parallel_for_static(n, fill_row, init_threads_);
 }
 
 template<typename T>
 bool MFSolver<T>::Initialize(
-		T alpha,
-		T l2,
+		C alpha,
+		C l2,
 		size_t user_num,size_t item_num,int latent_dim) {
 	alpha_ = alpha;
 	l2_ = l2;
@@ -155,9 +240,13 @@ bool MFSolver<T>::Initialize(
 	item_num_ = item_num;
 	feat_num_ = user_num + item_num;//using one large matrix store user and item latent factors
     l_dim_ = latent_dim;
-	u_ = new T*[feat_num_];
-    for (size_t i = 0; i < feat_num_; ++i) 
-        u_[i] = new T[l_dim_];
+	u_ = new T*[feat_num_]();
+	if (!store_path_.empty()) {
+		if (!AllocStoreRows(u_, feat_num_, l_dim_)) return false;
+		arena_rows_ = true;
+	} else {
+		arena_rows_ = AllocArenaRows(u_, feat_num_, l_dim_);
+	}
     set_float_rand(u_,feat_num_,l_dim_,0.01);
 	init_ = true;
 	return init_;
@@ -165,14 +254,36 @@ bool MFSolver<T>::Initialize(
 
 template<typename T>
 bool MFSolver<T>::Initialize(const char* path) {
-	std::fstream fin;
-	fin.open(path, std::ios::in);
-	if (!fin.is_open()) {
+	size_t user_num = 0, item_num = 0;
+	int l_dim = 0;
+	if (!read_model_shape(path, user_num, item_num, l_dim)) return false;
+	if (!Initialize(alpha_, l2_, user_num, item_num, l_dim)) return false;
+	return LoadModel(path);
+}
+
+template<typename T>
+bool MFSolver<T>::LoadModel(const char* path) {
+	if (!init_) return false;
+	size_t user_num = 0, item_num = 0;
+	int l_dim = 0;
+	if (!read_model_shape(path, user_num, item_num, l_dim)) {
+		printf("read model %s failed\n", path);
 		return false;
 	}
 
-	init_ = true;
-	return init_;
+	T** u = u_;
+	const size_t users = user_num_, items = item_num_;
+	auto dst = [u, users, items] (bool user, size_t k) -> T* {
+		if (user) return k < users ? u[k] : NULL;
+		return k < items ? u[users + k] : NULL;
+	};
+	if (!load_model_rows<T>(path, l_dim_, dst, init_threads_)) {
+		printf("load model %s failed\n", path);
+		return false;
+	}
+	printf("init model %s: %zu of %zu users, %zu of %zu items\n", path,
+		std::min(user_num, users), users, std::min(item_num, items), items);
+	return true;
 }
 
 template<typename T>
@@ -188,28 +299,11 @@ template<typename T>
 bool MFSolver<T>::SaveModel(const char* path) {
 	if (!init_) return false;
 
-	std::fstream fout;
-	std::ios_base::sync_with_stdio(false);
-	fout.open(path, std::ios::out);
-
-	if (!fout.is_open()) {
-		return false;
-	}
-
-	fout << std::fixed << std::setprecision(kPrecision);
-    //save feature dimension
-    fout << user_num_ << "\n";
-    fout << item_num_ << "\n";
-    //save latent factor dimension
-    fout << l_dim_ << "\n";
-	for (size_t i = 0; i < feat_num_; ++i) {
-        for (size_t j = 0; j < l_dim_ -1; ++j) {
-                fout << GetWeightSave(i,j)  << "\t";
-        }
-		fout << GetWeightSave(i,l_dim_-1)  << "\n";
-	}
-	fout.close();
-	return true;
+	T** u = u_;
+	auto row = [u] (size_t i) -> const T* { return u[i]; };
+	if (binary_model_)
+		return write_binary_model<T>(path, user_num_, item_num_, l_dim_, row, init_threads_);
+	return write_text_model<T>(path, user_num_, item_num_, l_dim_, row, init_threads_);
 }
 
 template<typename T>
@@ -233,19 +327,43 @@ public:
 
 	bool Initialize(const char* path);
 
-	T Predict(T& score,const std::vector<int>& x);
+	T Predict(T& score,const std::vector<mf_id_t>& x);
 private:
-	std::vector<T> model_;
+	//row of a raw id for models saved with dynamic ids, -1 when it has no row
+	long DenseRow(const std::unordered_map<uint64_t, size_t>& rows, mf_id_t id, size_t offset, size_t count) const {
+		if (id < 0) return -1;
+		if (!dynamic_) return static_cast<size_t>(id) < count ? static_cast<long>(id + offset) : -1;
+		std::unordered_map<uint64_t, size_t>::const_iterator it = rows.find(static_cast<uint64_t>(id));
+		return it == rows.end() ? -1 : static_cast<long>(it->second + offset);
+	}
+
+	//dot product of rows a and b, read in place when the model is mapped
+	T RowDot(size_t a, size_t b) const {
+		if (mapped_ != NULL)
+			return model_dot<T>(dtype_, rows_ + a * row_bytes_, rows_ + b * row_bytes_, l_dim_);
+		T sum = 0.;
+		for (int j = 0; j < l_dim_; ++j) sum += v_[a][j] * v_[b][j];
+		return sum;
+	}
+
+	std::vector<T> model_;	//rows of a text model
 	T**  v_;
+	FactorArena* mapped_;	//a binary model, used in place
+	const char* rows_;		//row 0 in the mapping
+	size_t row_bytes_;
+	uint32_t dtype_;
     size_t feat_num_;
     size_t user_num_;
     size_t item_num_;
     int l_dim_;
 	bool init_;
+	bool dynamic_;	//path.ids lists the raw id of every row
+	std::unordered_map<uint64_t, size_t> user_rows_;
+	std::unordered_map<uint64_t, size_t> item_rows_;
 };
 
 template<typename T>
-MFModel<T>::MFModel() : v_(NULL),init_(false) {
+MFModel<T>::MFModel() : v_(NULL),mapped_(NULL),rows_(NULL),row_bytes_(0),dtype_(0),init_(false),dynamic_(false) {
     feat_num_ = 0;
     l_dim_ = 0;
 }
@@ -254,45 +372,50 @@ template<typename T>
 MFModel<T>::~MFModel() {
 
     if (v_){
-	    for (size_t i = 0; i < feat_num_; ++i) 
-            if (v_[i] )
-                delete [] v_[i];
         delete [] v_;
     }
+    delete mapped_;
 }
 
 template<typename T>
 bool MFModel<T>::Initialize(const char* path) {
-	std::fstream fin;
-	fin.open(path, std::ios::in);
-	if (!fin.is_open()) {
+	//a binary model is mapped read only and its rows are used in place, pages come in
+	//on first use. the data crc is not checked here, that would read the whole file
+	BinaryModelHeader header;
+	if (read_binary_model_header(path, header)) {
+		mapped_ = new FactorArena();
+		if (!mapped_->MapReadOnly(path)) return false;
+		user_num_ = header.user_num;
+		item_num_ = header.item_num;
+		l_dim_ = header.l_dim;
+		rows_ = static_cast<const char*>(mapped_->base()) + header.data_offset;
+		row_bytes_ = header.row_bytes;
+		dtype_ = header.dtype;
+	} else if (read_text_model(path, user_num_, item_num_, l_dim_, model_)) {
+		v_ = new T*[user_num_ + item_num_];
+		for (size_t i = 0; i < user_num_ + item_num_; ++i) v_[i] = &model_[i * l_dim_];
+	} else {
 		return false;
 	}
-
-    fin >> user_num_; 
-    fin >> item_num_; 
 	feat_num_ = user_num_ + item_num_;
-    fin >> l_dim_ ; //get latentfactor dimension
-    v_ = new T*[feat_num_];
-	for (size_t i = 0; i < feat_num_; ++i) {
-        v_[i] = new T[l_dim_];
-	    for (size_t j = 0; j < l_dim_; ++j) {
-            fin >> v_[i][j];
-        }
-        if (!fin || fin.eof()) {
-            fin.close();
-            return false;
-        }
-	}
 
-	fin.close();
+	std::ifstream ids((std::string(path) + ".ids").c_str());
+	if (ids.is_open()) {
+		dynamic_ = true;
+		uint64_t id;
+		for (size_t i = 0; i < feat_num_ && ids >> id; ++i) {
+			if (i < user_num_) user_rows_[id] = i;
+			else item_rows_[id] = i - user_num_;
+		}
+		if (user_rows_.size() + item_rows_.size() != feat_num_) return false;
+	}
 
 	init_ = true;
 	return init_;
 }
 
 template<typename T>
-T MFModel<T>::Predict(T& score,const std::vector<int>& x) {
+T MFModel<T>::Predict(T& score,const std::vector<mf_id_t>& x) {
 	if (!init_) {
 		printf("model init failed !\n");
 		return 0;
@@ -300,20 +423,38 @@ T MFModel<T>::Predict(T& score,const std::vector<int>& x) {
 	T avg_rmse = 0.;
 	if (x.size() < 2)
 		return avg_rmse;
-	int userid = x[0];
+	long userid = DenseRow(user_rows_, x[0], 0, user_num_);
+	if (userid < 0)
+		return avg_rmse;
 
 	//group each user 's same score items in each line
 	for (int i = 1;i < x.size();i++) {
-		int item_id = x[i] + user_num_;
-		if (item_id >= feat_num_) break;
-		T pred_score = 0.;
-		for (size_t j=0; j < l_dim_; ++j) 
-			pred_score += v_[userid][j] * v_[item_id][j];
+		long item_id = DenseRow(item_rows_, x[i], user_num_, item_num_);
+		if (item_id < 0) break;
+		T pred_score = RowDot(userid, item_id);
 		avg_rmse += pow(pred_score - score,2);
 	}
 	return avg_rmse / (x.size() - 1);
 }
-void split_trainfiles(const char* train_files_list,std::vector<std::string>& split_train_list,int num_threads){
+//feat_num holds user num, item num and latent factor dimension, one each line
+bool read_feat_num(const char* path, size_t& user_num, size_t& item_num, int& latent_dim) {
+	std::fstream fin;
+	fin.open(path, std::ios::in);
+	if (!fin.is_open()) {
+		return false;
+	}
+	fin >> user_num;
+	fin >> item_num;
+	fin >> latent_dim;
+	bool ok = !fin.fail();
+	fin.close();
+	return ok;
+}
+
+//a non zero seed shuffles the file order first, so shards differ from epoch to epoch.
+//shard i is written to train_files_list + suffix + "." + i
+void split_trainfiles(const char* train_files_list,std::vector<std::string>& split_train_list,int num_threads,
+		uint64_t seed = 0, const char* suffix = ""){
 		std::ifstream fin;
 		fin.open(train_files_list);
 		std::vector<std::string> train_files_vec;
@@ -323,6 +464,10 @@ void split_trainfiles(const char* train_files_list,std::vector<std::string>& spl
 			train_files_vec.push_back(line);
 		}
 		fin.close();
+		if (seed != 0) {
+			std::mt19937_64 rng(seed);
+			std::shuffle(train_files_vec.begin(), train_files_vec.end(), rng);
+		}
 		if (train_files_vec.size() >= num_threads){
 			int split_num = num_threads;
 			int each_split_num = train_files_vec.size()/split_num;
@@ -331,7 +476,7 @@ void split_trainfiles(const char* train_files_list,std::vector<std::string>& spl
 				ss << i;	ss >> istr;
 				int j;
 				std::ofstream ofs;
-				std::string ofiles = std::string(train_files_list) + "." + istr;
+				std::string ofiles = std::string(train_files_list) + suffix + "." + istr;
 				ofs.open(ofiles.c_str());
 				for(j = i*each_split_num; j < (i+1)*each_split_num; j++)
 					ofs << train_files_vec[j] << "\n";
@@ -348,7 +493,7 @@ void split_trainfiles(const char* train_files_list,std::vector<std::string>& spl
 				std::strstream ss;	std::string istr;
 				ss << i;	ss >> istr;
 				std::ofstream ofs;
-				std::string ofiles = std::string(train_files_list) + "." + istr;
+				std::string ofiles = std::string(train_files_list) + suffix + "." + istr;
 				ofs.open(ofiles.c_str());
 				ofs << train_files_vec[i] << "\n";
 				ofs.close();
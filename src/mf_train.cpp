@@ -23,7 +23,10 @@
 #include <iostream>
 #include <locale>
 #include "src/fast_mf_solver.h"
+#include "src/als_mf_solver.h"
+#include "src/ccd_mf_solver.h"
 #include "src/mf_train.h"
+#include "src/nomad_mf_solver.h"
 #include "src/util.h"
 
 using namespace std;
@@ -37,6 +40,30 @@ void print_usage() {
 		"--thread num : set thread num, default is 2 threads. 0 will use hardware concurrency\n"
 		"--double-precision : set to use double precision, default false\n"
 		"--batch_size : set num of samples load in batch\n"
+		"--hot-items num : replicate the num most frequent items in each thread, default 0\n"
+		"--hot-merge-step num : merge hot item replicas every num batches, default 1\n"
+		"--user-shard : route lines to threads by user id, user rows are updated without sync\n"
+		"--solver name : training engine, sgd (default), nomad, als, ials or ccd\n"
+		"--confidence c : ials confidence of an observed score s is 1 + c * s, default 1\n"
+		"--loss name : sgd loss, squared (default) or bpr pairwise ranking with sampled negatives\n"
+		"--optimizer name : sgd step rule, sgd (default), adagrad or adam with per row rates\n"
+		"--lazy-l2 : sgd leaves l2 out of the update and scales a row by (1 - alpha * l2) per past update on its next touch\n"
+		"--shuffle lines : shuffle samples through a buffer of lines per thread and the file order each epoch\n"
+		"--shuffle-seed seed : seed of the sample and file order shuffle, default 1\n"
+		"--sweep file : train one sgd model per line \"alpha l2 dim model_file [fold]\" from a single pass over the data\n"
+		"--folds k : hash (user, item) pairs into k folds and hold one out for validation, default 0\n"
+		"--fold f : the fold held out, default 0, a sweep line may name its own fold\n"
+		"--valid file : score this file list on a snapshot after every epoch, in the background\n"
+		"--early-stop n : stop after n epochs without a better validation rmse and save the best epoch\n"
+		"--pin-threads : bind threads to cpus, filling one numa node before the next\n"
+		"--huge-pages : allocate the model and worker buffers on huge pages, see mf_bench\n"
+		"--storage type : sgd factor and delta storage, fp32 (default), bf16 or fp16, 16 bit types compute in fp32\n"
+		"--out-of-core dir : sgd keeps the model in a file mapping in dir and trains row block by row block\n"
+		"--row-blocks n : out of core user and item row ranges, n * n blocks, default 4\n"
+		"--dynamic-ids : sgd creates rows for raw ids as they appear, feat_num counts only presize, ids are saved to model_file.ids\n"
+		"--model-format fmt : text (default) or binary, a checksummed raw dump saved and loaded by every cpu, see mf_convert\n"
+		"--init-model file : warm start from a saved model, rows of users and items added since keep their random init\n"
+		"--checkpoint-step n : sgd saves a binary model_file.ckpt every n epochs, resume with --init-model model_file.ckpt\n"
 		"--help : print this help\n"
 	);
 }
@@ -62,13 +89,93 @@ static char* readline(FILE *input)
 	return line;
 }
 
+//engines that load the whole rating matrix and train on the in memory model
+template<typename Solver, typename T>
+bool train_engine(Solver& solver, const char* input_file, const char* model_file, T alpha, T l2,
+		size_t epoch, size_t num_threads, size_t user_num, size_t item_num, int latent_dim,
+		const MFTrainOption& option) {
+		solver.SetBinaryModel(option.binary_model);
+		if (!solver.Initialize(alpha, l2, user_num, item_num, latent_dim)) return false;
+		if (!option.init_model.empty() && !solver.LoadModel(option.init_model.c_str())) return false;
+		if (!solver.Train(input_file, epoch, num_threads)) return false;
+		return solver.SaveModelAll(model_file);
+	}
+
+//the parameter server engine, T is the storage type of its rows
 template<typename T>
-bool train(const char* input_file,  const char* model_file,
-		T alpha, T l2, 	size_t epoch, size_t push_step, size_t fetch_step, size_t num_threads, int batch_size) {
+bool train_sgd(const char* input_file,  const char* model_file,
+		double alpha, double l2, size_t epoch, size_t push_step, size_t fetch_step, size_t num_threads,
+		const MFTrainOption& option) {
 		FastMFTrainer<T> trainer;
 		trainer.Initialize(epoch, num_threads, push_step, fetch_step);
-		trainer.Train(alpha, l2, model_file, input_file);
-		return true;
+		trainer.SetOption(option);
+		if (!option.sweep_file.empty()) {
+			std::vector<MFSweepConfig> configs;
+			if (!read_sweep_configs(option.sweep_file.c_str(), configs)) {
+				printf("read sweep file %s failed\n", option.sweep_file.c_str());
+				return false;
+			}
+			return trainer.TrainSweep(configs, input_file);
+		}
+		return trainer.Train(alpha, l2, model_file, input_file);
+	}
+
+template<typename T>
+bool train(const char* input_file,  const char* model_file,
+		T alpha, T l2, 	size_t epoch, size_t push_step, size_t fetch_step, size_t num_threads, int batch_size,
+		const MFTrainOption& option) {
+		if (option.solver != "sgd") {
+			//options only the sgd trainer reads, the other engines would silently ignore them
+			const std::pair<bool, const char*> sgd_options[] = {
+				{!option.sweep_file.empty(), "--sweep"},
+				{!option.out_of_core.empty(), "--out-of-core"},
+				{option.dynamic_ids, "--dynamic-ids"},
+				{option.checkpoint_step > 0, "--checkpoint-step"},
+				{option.loss != "squared", "--loss"},
+				{!option.valid_file.empty(), "--valid"},
+				{option.early_stop > 0, "--early-stop"},
+				{option.folds > 0, "--folds"},
+				{option.hot_items > 0, "--hot-items"},
+				{option.user_shard, "--user-shard"},
+				{option.optimizer != "sgd", "--optimizer"},
+				{option.lazy_l2, "--lazy-l2"},
+				{option.shuffle_lines > 0, "--shuffle"},
+			};
+			for (size_t k = 0; k < sizeof(sgd_options) / sizeof(sgd_options[0]); ++k) {
+				if (sgd_options[k].first) {
+					printf("%s needs the sgd solver\n", sgd_options[k].second);
+					return false;
+				}
+			}
+			size_t user_num = 0, item_num = 0;
+			int latent_dim = 0;
+			if (!read_feat_num("./feat_num", user_num, item_num, latent_dim)) {
+				printf("please supply a file name feat_num including user num ,item num and latent fatctor dimension,one each line\n");
+				return false;
+			}
+			if (option.solver == "nomad") {
+				NomadMFSolver<T> solver;
+				return train_engine(solver, input_file, model_file, alpha, l2,
+					epoch, num_threads, user_num, item_num, latent_dim, option);
+			}
+			if (option.solver == "als" || option.solver == "ials") {
+				ALSMFSolver<T> solver;
+				if (option.solver == "ials")
+					solver.SetImplicit(static_cast<T>(option.confidence));
+				return train_engine(solver, input_file, model_file, alpha, l2,
+					epoch, num_threads, user_num, item_num, latent_dim, option);
+			}
+			if (option.solver == "ccd") {
+				CCDMFSolver<T> solver;
+				return train_engine(solver, input_file, model_file, alpha, l2,
+					epoch, num_threads, user_num, item_num, latent_dim, option);
+			}
+			printf("unknown solver %s\n", option.solver.c_str());
+			return false;
+		}
+
+		return train_sgd<T>(input_file, model_file, alpha, l2, epoch, push_step, fetch_step,
+			num_threads, option);
 	}
 
 
@@ -84,6 +191,30 @@ int main(int argc, char* argv[]) {
 		{"double-precision", no_argument, NULL, 'x'},
 		{"help", no_argument, NULL, 'h'},
 		{"batch_size", required_argument, NULL, 'y'},
+		{"hot-items", required_argument, NULL, 'o'},
+		{"hot-merge-step", required_argument, NULL, 'g'},
+		{"user-shard", no_argument, NULL, 'u'},
+		{"solver", required_argument, NULL, 'v'},
+		{"confidence", required_argument, NULL, 'w'},
+		{"loss", required_argument, NULL, 'l'},
+		{"optimizer", required_argument, NULL, 'p'},
+		{"lazy-l2", no_argument, NULL, 'z'},
+		{"shuffle", required_argument, NULL, 'b'},
+		{"shuffle-seed", required_argument, NULL, 'd'},
+		{"sweep", required_argument, NULL, 'r'},
+		{"folds", required_argument, NULL, 'k'},
+		{"fold", required_argument, NULL, 'j'},
+		{"valid", required_argument, NULL, 't'},
+		{"early-stop", required_argument, NULL, 'q'},
+		{"pin-threads", no_argument, NULL, 'A'},
+		{"huge-pages", no_argument, NULL, 'H'},
+		{"storage", required_argument, NULL, 'S'},
+		{"out-of-core", required_argument, NULL, 'O'},
+		{"row-blocks", required_argument, NULL, 'B'},
+		{"dynamic-ids", no_argument, NULL, 'D'},
+		{"model-format", required_argument, NULL, 'M'},
+		{"init-model", required_argument, NULL, 'I'},
+		{"checkpoint-step", required_argument, NULL, 'K'},
 		{0, 0, 0, 0}
 	};
 
@@ -108,6 +239,8 @@ int main(int argc, char* argv[]) {
 	double burn_in_phase = 0;
 
 	bool double_precision = false;
+	std::string storage = "fp32";
+	MFTrainOption option;
 
 	while ((opt = getopt_long(argc, argv, "f:m:ch", long_options, &opt_idx)) != -1) {
 		switch (opt) {
@@ -139,6 +272,82 @@ int main(int argc, char* argv[]) {
 		case 'y':
 			batch_size = atoi(optarg);
 			break;
+		case 'o':
+			option.hot_items = (size_t)atoi(optarg);
+			break;
+		case 'g':
+			option.hot_merge_step = std::max(1, atoi(optarg));
+			break;
+		case 'u':
+			option.user_shard = true;
+			break;
+		case 'v':
+			option.solver = optarg;
+			break;
+		case 'w':
+			option.confidence = atof(optarg);
+			break;
+		case 'l':
+			option.loss = optarg;
+			break;
+		case 'p':
+			option.optimizer = optarg;
+			break;
+		case 'z':
+			option.lazy_l2 = true;
+			break;
+		case 'b':
+			option.shuffle_lines = (size_t)atol(optarg);
+			break;
+		case 'd':
+			option.shuffle_seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			option.sweep_file = optarg;
+			break;
+		case 'k':
+			option.folds = (size_t)atol(optarg);
+			break;
+		case 'j':
+			option.fold = (size_t)atol(optarg);
+			break;
+		case 't':
+			option.valid_file = optarg;
+			break;
+		case 'q':
+			option.early_stop = (size_t)atol(optarg);
+			break;
+		case 'A':
+			option.pin_threads = true;
+			break;
+		case 'H':
+			huge_pages_enabled() = true;
+			break;
+		case 'S':
+			storage = optarg;
+			break;
+		case 'O':
+			option.out_of_core = optarg;
+			break;
+		case 'B':
+			option.row_blocks = std::max(1, atoi(optarg));
+			break;
+		case 'D':
+			option.dynamic_ids = true;
+			break;
+		case 'M':
+			if (std::string(optarg) != "text" && std::string(optarg) != "binary") {
+				printf("unknown model format %s\n", optarg);
+				exit(1);
+			}
+			option.binary_model = std::string(optarg) == "binary";
+			break;
+		case 'I':
+			option.init_model = optarg;
+			break;
+		case 'K':
+			option.checkpoint_step = std::max(0, atoi(optarg));
+			break;
 		case 'h':
 		default:
 			print_usage();
@@ -146,20 +355,44 @@ int main(int argc, char* argv[]) {
 		}
 	}
 
-	if (input_file.size() == 0 || model_file.size() == 0) {
+	if (input_file.size() == 0 || (model_file.size() == 0 && option.sweep_file.size() == 0)) {
 		print_usage();
 		exit(1);
 	}
 
 
-	if (double_precision) {
-		train<double>(input_file.c_str(),  model_file.c_str(),alpha, l2, 
-			epoch, push_step, fetch_step, num_threads, batch_size);
+	global_thread_pool().SetPinning(option.pin_threads);
+
+	bool ok = false;
+
+	if (storage != "fp32") {
+		if (storage != "bf16" && storage != "fp16") {
+			printf("unknown storage %s\n", storage.c_str());
+			exit(1);
+		}
+		if (option.solver != "sgd" || double_precision) {
+			printf("--storage %s needs the sgd solver in single precision\n", storage.c_str());
+			exit(1);
+		}
+		if (storage == "bf16") {
+			ok = train_sgd<bf16>(input_file.c_str(), model_file.c_str(), alpha, l2,
+				epoch, push_step, fetch_step, num_threads, option);
+		} else {
+			ok = train_sgd<fp16>(input_file.c_str(), model_file.c_str(), alpha, l2,
+				epoch, push_step, fetch_step, num_threads, option);
+		}
+	} else if (double_precision) {
+		ok = train<double>(input_file.c_str(),  model_file.c_str(),alpha, l2, 
+			epoch, push_step, fetch_step, num_threads, batch_size, option);
 	} else {
-		train<float>(input_file.c_str(),  model_file.c_str(),alpha, l2, 
-			epoch, push_step, fetch_step, num_threads, batch_size);
+		ok = train<float>(input_file.c_str(),  model_file.c_str(),alpha, l2, 
+			epoch, push_step, fetch_step, num_threads, batch_size, option);
 	}
 
+	if (!ok) {
+		printf("training failed\n");
+		return 1;
+	}
 	return 0;
 }
 /* vim: set ts=4 sw=4 tw=0 noet :*/
@@ -22,6 +22,7 @@
 #define SRC_MF_TRAIN_H
 
 #include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <fstream>
 #include <string>
@@ -29,17 +30,85 @@
 #include <vector>
 #include <strstream>
 #include <map>
+#include <memory>
+#include "src/blocking_queue.h"
 #include "src/fast_mf_solver.h"
 #include "src/file_parser.h"
 #include "src/mf_solver.h"
+#include "src/mf_validator.h"
+#include "src/sample_batch.h"
+#include "src/shuffle_buffer.h"
 #include "src/stopwatch.h"
 
 const int DEFAULT_BATCH_SIZE = 100000;
 
+struct MFTrainOption {
+	size_t hot_items;		//most frequent items each worker replicates privately, 0 disables
+	size_t hot_merge_step;	//batches between two merges of the hot item replicas
+	bool user_shard;		//route lines to workers by user id so user rows need no sync
+	bool pin_threads;		//bind pool threads to cpus, grouped by numa node
+	std::string solver;		//training engine: sgd, nomad, als, ials or ccd
+	double confidence;		//ials confidence weight of an observed score
+	std::string loss;		//sgd loss: squared or bpr
+	std::string optimizer;	//sgd step rule: sgd, adagrad or adam
+	bool lazy_l2;			//decay rows for their past updates on their next touch instead of in every update
+	size_t shuffle_lines;	//per thread shuffle buffer lines, non zero also shuffles the file order each epoch
+	uint64_t shuffle_seed;	//seed of the file order and of the shuffle buffers
+	std::string sweep_file;	//one sgd model per config line, all fed from one data pass
+	size_t folds;			//hash (user, item) pairs into folds, 0 trains on everything
+	size_t fold;			//the fold held out for validation
+	std::string valid_file;	//file list scored on a snapshot after every epoch, in the background
+	size_t early_stop;		//stop after this many epochs without a better validation rmse, 0 never
+	std::string out_of_core;	//directory of the file backed models and the row block spill, empty trains in memory
+	size_t row_blocks;		//out of core user and item row ranges, row_blocks^2 blocks are trained one at a time
+	bool dynamic_ids;		//key rows by raw ids in growing hash maps instead of dense ids below ./feat_num
+	bool binary_model;		//save models in the binary format of model_io.h instead of text
+	std::string init_model;	//warm start the rows from this model, its id ranges may be smaller
+	size_t checkpoint_step;	//save model_file.ckpt every this many epochs, 0 never
+
+	MFTrainOption() : hot_items(0), hot_merge_step(1), user_shard(false), pin_threads(false), solver("sgd"),
+		confidence(1.), loss("squared"), optimizer("sgd"), lazy_l2(false),
+		shuffle_lines(0), shuffle_seed(1), folds(0), fold(0), early_stop(0), row_blocks(4),
+		dynamic_ids(false), binary_model(false), checkpoint_step(0) {}
+};
+
+//one model of a hyperparameter sweep
+struct MFSweepConfig {
+	double alpha;
+	double l2;
+	int latent_dim;			//0 takes the dimension of ./feat_num
+	std::string model_file;
+	int fold;				//held out fold, -1 takes --fold
+};
+
+//one config per line: alpha l2 dim model_file [fold], lines starting with # are skipped.
+//giving each fold its own line cross validates all folds in one pass
+inline bool read_sweep_configs(const char* path, std::vector<MFSweepConfig>& configs) {
+	std::ifstream fin(path);
+	if (!fin.is_open()) return false;
+	std::string line;
+	while (getline(fin, line)) {
+		if (line.empty() || line[0] == '#') continue;
+		char model_file[1024];
+		MFSweepConfig config;
+		config.fold = -1;
+		if (sscanf(line.c_str(), "%lf %lf %d %1023s %d", &config.alpha, &config.l2,
+				&config.latent_dim, model_file, &config.fold) < 4) {
+			printf("bad sweep config line: %s\n", line.c_str());
+			return false;
+		}
+		config.model_file = model_file;
+		configs.push_back(config);
+	}
+	return !configs.empty();
+}
 
 template<typename T>
 class FastMFTrainer {
 public:
+	//samples and scores are parsed in the compute type, the models store T
+	typedef typename compute_type<T>::type C;
+
 	FastMFTrainer();
 
 	virtual ~FastMFTrainer();
@@ -50,22 +119,56 @@ public:
 		size_t push_step = kPushStep,
 		size_t fetch_step = kFetchStep);
 
+	void SetOption(const MFTrainOption& option) { option_ = option; }
+
 	bool Train(
-		T alpha,
-		T l2,
+		C alpha,
+		C l2,
 		const char* model_file,
 		const char* train_file);
+	//train one model per config, each parsed batch is fed to all of them
+	bool TrainSweep(
+		const std::vector<MFSweepConfig>& configs,
+		const char* train_file);
 
 protected:
-	bool TrainImpl(
-		const char* model_file,
-		const char* train_file);
+	//split_train_list holds the shard of every thread, from split_trainfiles
+	bool TrainImpl(const char* train_file, std::vector<std::string>& split_train_list);
 
-    bool LoadBatchSamples(FileParser<T>& file_parser,
-          std::vector<T>& train_samples_scores,
-          std::vector<std::vector<int> >& train_samples,
+    bool LoadBatchSamples(FileParser<C>& file_parser,
+          MFSampleBatch<C>& batch,
           int batch_size);
+	//read the next batch through the shuffle buffer, which is drained once the file ends
+	bool NextBatch(FileParser<C>& file_parser, ShuffleBuffer<C>& shuffle, MFSampleBatch<C>& batch);
     void get_feat_num();
+	//item popularity over every line of every shard, the bpr negative distribution. a full
+	//pass, inputs sorted by user or time would bias any prefix of the shards
+	bool BuildNegativeSampler(const std::vector<std::string>& split_train_list);
+	//out of core: spill every shard into row_blocks x row_blocks files by user block and
+	//item block, a line is cut between the item blocks of its items. block_lists[b * row_blocks + c][i]
+	//lists the file thread i trains from while user block b and item block c are resident
+	bool PartitionRowBlocks(const std::vector<std::string>& split_train_list,
+		std::vector<std::vector<std::string> >& block_lists);
+	//first row of block b when n rows are cut into row_blocks ranges, b = row * row_blocks / n
+	size_t BlockBegin(size_t n, size_t b) {
+		return (n * b + option_.row_blocks - 1) / option_.row_blocks;
+	}
+	//spill file of block k from shard i, its file list has ".list" appended
+	std::string BlockFile(size_t k, size_t i) {
+		return option_.out_of_core + "/block." + std::to_string(k) + "." + std::to_string(i);
+	}
+	//file store of model m out of core, removed once the model is saved
+	std::string StoreFile(size_t m) {
+		return option_.out_of_core + "/model." + std::to_string(m) + ".store";
+	}
+	//save model m to model_file.ckpt through a temporary file, so a crash while saving
+	//leaves the previous checkpoint intact
+	bool SaveCheckpoint(size_t m);
+	//squared loss reports rmse, bpr reports the mean misranking probability
+	double AvgLoss(double sum, long long count) {
+		if (count <= 0) return 0.;
+		return option_.loss == "bpr" ? sum / count : sqrt(sum / count);
+	}
 	//if split_train_list size less than num_threads,change num_threads_ to files number
 	//void split_trainfiles(const char* train_files_list,std::vector<std::string>& split_train_list,int num_threads);
 private:
@@ -76,38 +179,47 @@ private:
 	size_t item_num_;
 	int latent_dim_;
 
-	MFParamServer<T> param_server_;
+	//a model of the sweep with its own server and workers
+	struct Model {
+		MFParamServer<T> param_server;
+		MFWorker<T>* solvers;
+		std::string model_file;
+		size_t fold;
+		double loss;
+		long long pairs;		//trained pairs, the loss divisor
+		double valid_loss;
+		long long valid_count;
+
+		Model() : solvers(NULL), fold(0), loss(0.), pairs(0), valid_loss(0.), valid_count(0) {}
+		~Model() { delete [] solvers; }
+	};
+
+	std::vector<std::unique_ptr<Model> > models_;
 	size_t num_threads_;
+	MFTrainOption option_;
+	AliasSampler neg_sampler_;
 
 	bool init_;
 };
-template<typename T>                                                                                                                                  
-void FastMFTrainer<T>::get_feat_num() {                                                                                                           
-    std::fstream fin;                                                                                                                                 
-    fin.open("./feat_num", std::ios::in);                                                                                                             
-    if (!fin.is_open()) {                                                                                                                             
-        printf("please supply a file name feat_num including user num ,item num and latent fatctor dimension,one each line");
+template<typename T>
+void FastMFTrainer<T>::get_feat_num() {
+	if (!read_feat_num("./feat_num", user_num_, item_num_, latent_dim_)) {
+		printf("please supply a file name feat_num including user num ,item num and latent fatctor dimension,one each line");
 		exit(-1);
-    }                                                                                                                                                 
-    fin >> user_num_;                                                                                                                                  
-    fin >> item_num_;                                                                                                                                  
-    fin >> latent_dim_;                                                                                                                                  
-    fin.close();                                                                                                                                      
-}      
+	}
+}
 
 
 
 template<typename T>
-bool FastMFTrainer<T>::LoadBatchSamples(FileParser<T>& file_parser,
-          std::vector<T>& train_samples_scores,
-          std::vector<std::vector<int> >& train_samples,
+bool FastMFTrainer<T>::LoadBatchSamples(FileParser<C>& file_parser,
+          MFSampleBatch<C>& batch,
           int batch_size){
 	int cnt = 0;
-	std::vector<int> x;
-	T score;
+	std::vector<mf_id_t> x;
+	C score;
 	while (file_parser.ReadSample(score,x)) {
-		train_samples.push_back(x);
-		train_samples_scores.push_back(score);
+		batch.Add(score, x);
         ++cnt;
 		if (cnt >= batch_size)
 			break;
@@ -117,103 +229,550 @@ bool FastMFTrainer<T>::LoadBatchSamples(FileParser<T>& file_parser,
     return false;
 }
 
+template<typename T>
+bool FastMFTrainer<T>::NextBatch(FileParser<C>& file_parser, ShuffleBuffer<C>& shuffle,
+		MFSampleBatch<C>& batch) {
+	if (!shuffle.enabled())
+		return LoadBatchSamples(file_parser, batch, DEFAULT_BATCH_SIZE);
+
+	MFSampleBatch<C> raw;
+	while (batch.empty()) {
+		if (!LoadBatchSamples(file_parser, raw, DEFAULT_BATCH_SIZE)) {
+			shuffle.Drain(batch, DEFAULT_BATCH_SIZE);
+			break;
+		}
+		shuffle.Push(raw, batch);
+	}
+	return !batch.empty();
+}
+
+
+template<typename T>
+bool FastMFTrainer<T>::BuildNegativeSampler(const std::vector<std::string>& split_train_list) {
+	//add one smoothing keeps every item drawable
+	std::vector<double> weights(item_num_, 1.);
+	SpinLock lock;
+	auto count_func = [&] (size_t i) {
+		FileParser<C> file_parser;
+		if (!file_parser.OpenFile(split_train_list[i].c_str())) return;
+		std::vector<uint64_t> local(item_num_, 0);
+		C score;
+		std::vector<mf_id_t> x;
+		while (file_parser.ReadSample(score,x)) {
+			for (size_t j = 1; j < x.size(); ++j) {
+				if (x[j] >= 0 && static_cast<size_t>(x[j]) < item_num_) ++local[x[j]];
+			}
+		}
+		file_parser.CloseFile();
+
+		std::lock_guard<SpinLock> lockguard(lock);
+		for (size_t k = 0; k < item_num_; ++k) weights[k] += local[k];
+	};
+	util_parallel_run(count_func, split_train_list.size());
+	return neg_sampler_.Build(weights);
+}
+
+template<typename T>
+bool FastMFTrainer<T>::PartitionRowBlocks(const std::vector<std::string>& split_train_list,
+		std::vector<std::vector<std::string> >& block_lists) {
+	const size_t blocks = option_.row_blocks;
+	const size_t threads = split_train_list.size();
+	block_lists.assign(blocks * blocks, std::vector<std::string>(threads));
+	for (size_t k = 0; k < blocks * blocks; ++k) {
+		for (size_t i = 0; i < threads; ++i) {
+			block_lists[k][i] = BlockFile(k, i) + ".list";
+			std::ofstream ofs(block_lists[k][i].c_str());
+			ofs << BlockFile(k, i) << "\n";
+			if (!ofs) return false;
+		}
+	}
+
+	std::atomic<bool> ok(true);
+	auto spill_func = [&] (size_t i) {
+		std::vector<FILE*> out(blocks * blocks, NULL);
+		//enough digits for the score to read back unchanged
+		const char* line_fmt = sizeof(C) > sizeof(float) ? "%lld\t%.17g%s\n" : "%lld\t%.9g%s\n";
+		for (size_t k = 0; k < out.size(); ++k) {
+			out[k] = fopen(BlockFile(k, i).c_str(), "w");
+			if (!out[k]) ok = false;
+		}
+		FileParser<C> file_parser;
+		if (ok && file_parser.OpenFile(split_train_list[i].c_str())) {
+			std::vector<std::string> items(blocks);
+			C score;
+			std::vector<mf_id_t> x;
+			char buf[24];
+			while (file_parser.ReadSample(score, x)) {
+				if (x.size() < 2 || x[0] < 0 || static_cast<size_t>(x[0]) >= user_num_) continue;
+				size_t b = static_cast<size_t>(x[0]) * blocks / user_num_;
+				for (size_t c = 0; c < blocks; ++c) items[c].clear();
+				for (size_t j = 1; j < x.size(); ++j) {
+					if (x[j] < 0 || static_cast<size_t>(x[j]) >= item_num_) break;
+					snprintf(buf, sizeof(buf), "\t%lld", static_cast<long long>(x[j]));
+					items[static_cast<size_t>(x[j]) * blocks / item_num_] += buf;
+				}
+				for (size_t c = 0; c < blocks; ++c) {
+					if (!items[c].empty())
+						fprintf(out[b * blocks + c], line_fmt, static_cast<long long>(x[0]),
+							static_cast<double>(score), items[c].c_str());
+				}
+			}
+			file_parser.CloseFile();
+		}
+		for (size_t k = 0; k < out.size(); ++k) {
+			if (out[k] && fclose(out[k]) != 0) ok = false;
+		}
+	};
+	util_parallel_run(spill_func, threads);
+	return ok;
+}
 
 template<typename T>
 bool FastMFTrainer<T>::Train(
-		T alpha,
-		T l2,
+		C alpha,
+		C l2,
 		const char* model_file,
 		const char* train_file) {
 	if (!init_) return false;
 
+	MFSweepConfig config;
+	config.alpha = alpha;
+	config.l2 = l2;
+	config.latent_dim = 0;
+	config.model_file = model_file;
+	config.fold = -1;
+	return TrainSweep(std::vector<MFSweepConfig>(1, config), train_file);
+}
+
+template<typename T>
+bool FastMFTrainer<T>::TrainSweep(
+		const std::vector<MFSweepConfig>& configs,
+		const char* train_file) {
+	if (!init_) return false;
+
     get_feat_num();
 	if (user_num_ == 0 || item_num_ == 0 || latent_dim_ == 0) return false;
 
-	if (!param_server_.Initialize(alpha, l2,user_num_,item_num_,latent_dim_)){
-		return false;
+	//the thread count is settled by the file split before any layout is built from it,
+	//the numa rows and the user shard router must agree on it
+	std::vector<std::string> split_train_list;
+	split_trainfiles(train_file,split_train_list,num_threads_,
+		option_.shuffle_lines > 0 ? option_.shuffle_seed : 0);
+	if(split_train_list.size() < num_threads_ )
+		num_threads_ = split_train_list.size();
+	if (num_threads_ == 0) return false;
+
+	models_.clear();
+	for (size_t m = 0; m < configs.size(); ++m) {
+		int dim = configs[m].latent_dim > 0 ? configs[m].latent_dim : latent_dim_;
+		models_.emplace_back(new Model());
+		models_[m]->param_server.SetInitThreads(num_threads_);
+		models_[m]->param_server.SetBinaryModel(option_.binary_model);
+		if (option_.dynamic_ids) {
+			models_[m]->param_server.SetDynamicIds(true);
+		} else if (!option_.out_of_core.empty()) {
+			models_[m]->param_server.SetStoreFile(StoreFile(m));
+		} else if (option_.pin_threads) {
+			std::vector<int> worker_nodes(num_threads_);
+			for (size_t i = 0; i < num_threads_; ++i) worker_nodes[i] = global_thread_pool().node(i);
+			models_[m]->param_server.SetNumaLayout(worker_nodes);
+		}
+		if (!models_[m]->param_server.Initialize(static_cast<C>(configs[m].alpha),
+				static_cast<C>(configs[m].l2), user_num_, item_num_, dim)) {
+			return false;
+		}
+		if (!option_.init_model.empty() && !models_[m]->param_server.LoadModel(option_.init_model.c_str()))
+			return false;
+		models_[m]->model_file = configs[m].model_file;
+		models_[m]->fold = configs[m].fold >= 0 ? configs[m].fold : option_.fold;
+		if (option_.folds > 0 && models_[m]->fold >= option_.folds) {
+			printf("fold %zu out of range, %zu folds\n", models_[m]->fold, option_.folds);
+			return false;
+		}
 	}
-	return TrainImpl(model_file, train_file);
+	return TrainImpl(train_file, split_train_list);
 }
 
 
 template<typename T>
-bool FastMFTrainer<T>::TrainImpl(
-		const char* model_file,
-		const char* train_file) {
+bool FastMFTrainer<T>::TrainImpl(const char* train_file, std::vector<std::string>& split_train_list) {
 	if (!init_) return false;
 
-	fprintf(
-		stdout,
-		"params={alpha:%.4f, l2:%.4f, epoch:%zu}\n",
-		static_cast<float>(param_server_.alpha()),
-		static_cast<float>(param_server_.l2()),
-		epoch_);
+	OptimizerType opt_type;
+	if (!parse_optimizer(option_.optimizer, opt_type)) {
+		printf("unknown optimizer %s\n", option_.optimizer.c_str());
+		return false;
+	}
+	const size_t model_num = models_.size();
+	//a sweep tags every report with the model index
+	auto model_tag = [&] (size_t m) {
+		return model_num > 1 ? "model=" + std::to_string(m) + " " : std::string();
+	};
+	for (size_t m = 0; m < model_num; ++m) {
+		MFParamServer<T>& ps = models_[m]->param_server;
+		ps.SetOptimizer(opt_type);
+		ps.SetLazyL2(option_.lazy_l2);
+		fprintf(
+			stdout,
+			"%sparams={alpha:%.4f, l2:%.4f, dim:%d, epoch:%zu, optimizer:%s, shuffle:%zu, holdout:%zu/%zu}\n",
+			model_tag(m).c_str(),
+			static_cast<float>(ps.alpha()),
+			static_cast<float>(ps.l2()),
+			ps.l_dim(), epoch_, option_.optimizer.c_str(), option_.shuffle_lines,
+			models_[m]->fold, option_.folds);
+	}
 
-	std::vector<std::string> split_train_list;
+	bool bpr = option_.loss == "bpr";
+	const char* loss_name = bpr ? "bpr loss" : "rmse";
+	if (bpr && !BuildNegativeSampler(split_train_list)) {
+		printf("build negative sampler failed\n");
+		return false;
+	}
 
-	split_trainfiles(train_file,split_train_list,num_threads_);
-	if(split_train_list.size() < num_threads_ )
-		num_threads_ = split_train_list.size();
+	if (option_.dynamic_ids && (bpr || opt_type != kOptSGD || option_.lazy_l2 || option_.hot_items > 0
+			|| !option_.valid_file.empty() || !option_.out_of_core.empty())) {
+		printf("--dynamic-ids trains the squared loss with plain sgd steps, without --lazy-l2,"
+			" --hot-items, --valid and --out-of-core\n");
+		return false;
+	}
 
-	MFWorker<T>* solvers = new MFWorker<T>[num_threads_];
-	for (size_t i = 0; i < num_threads_; ++i) {
-		solvers[i].Initialize(&param_server_, push_step_, fetch_step_);
+	bool out_of_core = !option_.out_of_core.empty();
+	std::vector<std::vector<std::string> > block_lists;
+	if (out_of_core) {
+		//the in memory replicas, snapshots and routing these need are what out of core avoids
+		if (option_.user_shard || option_.hot_items > 0 || !option_.valid_file.empty()) {
+			printf("--out-of-core trains without --user-shard, --hot-items and --valid\n");
+			return false;
+		}
+		StopWatch spill_timer;
+		if (!PartitionRowBlocks(split_train_list, block_lists)) {
+			printf("spill row blocks to %s failed\n", option_.out_of_core.c_str());
+			return false;
+		}
+		fprintf(stdout, "out of core, %zu x %zu row blocks spilled in %.1fs\n",
+			option_.row_blocks, option_.row_blocks, spill_timer.StopTimer());
 	}
 
+	for (size_t m = 0; m < model_num; ++m) models_[m]->solvers = new MFWorker<T>[num_threads_];
+	//worker i is set up on pool thread i, which later trains with it
+	auto init_worker = [&] (size_t i) {
+		for (size_t m = 0; m < model_num; ++m) {
+			MFWorker<T>* solvers = models_[m]->solvers;
+			solvers[i].Initialize(&models_[m]->param_server, push_step_, fetch_step_);
+			solvers[i].SetHotItems(option_.hot_items);
+			if (bpr) solvers[i].SetNegativeSampler(&neg_sampler_, i + 1);
+			//in user shard mode parser threads route lines by user id, so each user row has one owner
+			solvers[i].SetUserOwned(option_.user_shard);
+			solvers[i].SetHoldout(option_.folds, models_[m]->fold);
+			solvers[i].SetNode(global_thread_pool().node(i));
+		}
+	};
+	util_parallel_run(init_worker, num_threads_);
+
+	std::vector<BlockingQueue<MFSampleBatch<C> > > queues(option_.user_shard ? num_threads_ : 0);
+
+	//validation runs on a quarter of the threads, next to the training threads
+	MFValidator<T> validator;
+	bool validate = !option_.valid_file.empty();
+	if (validate && bpr) {
+		printf("--valid scores rmse and needs the squared loss\n");
+		return false;
+	}
+	if (validate && !validator.Initialize(option_.valid_file.c_str(),
+			std::max<size_t>(1, num_threads_ / 4), model_num)) {
+		printf("open valid file %s failed\n", option_.valid_file.c_str());
+		return false;
+	}
+	std::vector<MFSolver<T>*> servers;
+	for (size_t m = 0; m < model_num; ++m) servers.push_back(&models_[m]->param_server);
+	std::vector<size_t> stale(model_num, 0);
+	//report a finished validation, true once every model has stopped improving
+	auto collect_validation = [&] () {
+		size_t valid_epoch;
+		std::vector<double> valid_rmse;
+		std::vector<char> improved;
+		if (!validator.Wait(valid_epoch, valid_rmse, improved)) return false;
+		bool stop = option_.early_stop > 0;
+		for (size_t m = 0; m < model_num; ++m) {
+			stale[m] = improved[m] ? 0 : stale[m] + 1;
+			if (stale[m] < option_.early_stop) stop = false;
+			fprintf(stdout,"%sepoch=%zu valid rmse is [%f]%s\n", model_tag(m).c_str(),
+				valid_epoch, valid_rmse[m], improved[m] ? " (best)" : "");
+		}
+		return stop;
+	};
+
+	//a failed checkpoint does not stop training, but the run reports failure
+	bool ok = true;
 	StopWatch timer;
 	for (size_t iter = 0; iter < epoch_; ++iter) {
+		bool shuffle = option_.shuffle_lines > 0;
+		if (shuffle && iter > 0 && !out_of_core) {
+			//same shard count, new file to thread assignment and order every epoch
+			split_train_list.clear();
+			split_trainfiles(train_file, split_train_list, num_threads_, option_.shuffle_seed + iter);
+		}
+		auto shuffle_seed = [&] (size_t i) {
+			return (option_.shuffle_seed + iter) * 0x9e3779b97f4a7c15ULL + i;
+		};
 
-		size_t cur_cnt = 0, cur_w_indx = 0;
 		long long count = 0;
-		double rmse = 0.;
+		long long last_print = 0;
+		for (size_t m = 0; m < model_num; ++m) {
+			models_[m]->loss = 0.;
+			models_[m]->pairs = 0;
+			models_[m]->valid_loss = 0.;
+			models_[m]->valid_count = 0;
+		}
 
 		SpinLock lock;
+		auto train_batch = [&] (size_t i, MFSampleBatch<C>& batch, size_t batch_idx) {
+			thread_local std::vector<double> local_loss, valid_loss;
+			thread_local std::vector<size_t> local_pairs, valid_count;
+			local_loss.assign(model_num, 0.);
+			local_pairs.assign(model_num, 0);
+			valid_loss.assign(model_num, 0.);
+			valid_count.assign(model_num, 0);
+			for (size_t m = 0; m < model_num; ++m) {
+				MFParamServer<T>* ps = &models_[m]->param_server;
+				MFWorker<T>& solver = models_[m]->solvers[i];
+				double local_mse = 0.;
+				thread_local std::vector<mf_id_t> x;
+				C score;
+				typename MFSampleBatch<C>::Reader reader(batch);
+				while (reader.Next(score, x))
+					local_mse += solver.Update(score,x,ps,local_pairs[m]);
+				local_loss[m] = local_mse;
+				solver.TakeValidation(valid_loss[m], valid_count[m]);
+
+				if (option_.hot_items > 0) {
+					//the first batch of each epoch refreshes the hot set from the decayed hit counts
+					if (batch_idx == 0)
+						solver.RefreshHotRows(ps);
+					else if (batch_idx % option_.hot_merge_step == 0)
+						solver.MergeHotRows(ps);
+				}
+			}
+
+			std::lock_guard<SpinLock> lockguard(lock);
+			count += batch.size();
+			for (size_t m = 0; m < model_num; ++m) {
+				models_[m]->loss += local_loss[m];
+				models_[m]->pairs += local_pairs[m];
+				models_[m]->valid_loss += valid_loss[m];
+				models_[m]->valid_count += valid_count[m];
+			}
+			if (count - last_print >= DEFAULT_BATCH_SIZE){
+				last_print = count;
+				fprintf(stdout,"epoch=%zu processed=[%lld],avg %s is [%f] \r",iter,count,loss_name,AvgLoss(models_[0]->loss, models_[0]->pairs) );
+				fflush(stdout);
+			}
+		};
+		auto push_params = [&] (size_t i) {
+			for (size_t m = 0; m < model_num; ++m)
+				models_[m]->solvers[i].PushParam(&models_[m]->param_server);
+		};
+
+		//the files the workers train from, swapped per block out of core
+		const std::vector<std::string>* shard_files = &split_train_list;
 		auto worker_func = [&] (size_t i) {
-			FileParser<T> file_parser;
+			FileParser<C> file_parser;
+			file_parser.OpenFile((*shard_files)[i].c_str());
+
+			ShuffleBuffer<C> shuffle_buffer;
+			if (shuffle) shuffle_buffer.Initialize(option_.shuffle_lines, shuffle_seed(i));
+			size_t batch_idx = 0;
+			MFSampleBatch<C> batch;
+
+			while (NextBatch(file_parser,shuffle_buffer,batch) ) {
+				train_batch(i, batch, batch_idx++);
+				batch.clear(); 
+			}
+        push_params(i);
+		file_parser.CloseFile();
+
+	};
+
+		std::atomic<size_t> parsers_running(num_threads_);
+		//workers take the first num_threads_ pool threads, where their memory was first touched
+		auto shard_func = [&] (size_t t) {
+			if (t < num_threads_) {
+				size_t w = t;
+				size_t batch_idx = 0;
+				MFSampleBatch<C> batch;
+				while (queues[w].Pop(batch))
+					train_batch(w, batch, batch_idx++);
+				push_params(w);
+				return;
+			}
+
+			size_t i = t - num_threads_;
+			FileParser<C> file_parser;
 			file_parser.OpenFile(split_train_list[i].c_str());
 
-			int	batch_size = DEFAULT_BATCH_SIZE;
-			size_t local_count = 0;
+			ShuffleBuffer<C> shuffle_buffer;
+			if (shuffle) shuffle_buffer.Initialize(option_.shuffle_lines, shuffle_seed(i));
+			MFSampleBatch<C> batch;
+			std::vector<MFSampleBatch<C> > routed(num_threads_);
+			while (NextBatch(file_parser,shuffle_buffer,batch) ) {
+				typename MFSampleBatch<C>::Reader reader(batch);
+				C score;
+				const char* begin;
+				const char* end;
+				while (reader.NextEncoded(score, begin, end)) {
+					size_t w = static_cast<uint64_t>(sample_user(begin)) % num_threads_;
+					routed[w].AddEncoded(score, begin, end);
+				}
+				for (size_t w = 0; w < num_threads_; ++w) {
+					if (routed[w].empty()) continue;
+					queues[w].Push(std::move(routed[w]));
+					routed[w] = MFSampleBatch<C>();
+				}
+				batch.clear(); 
+			}
+			file_parser.CloseFile();
+
+			if (--parsers_running == 0) {
+				for (size_t w = 0; w < num_threads_; ++w) queues[w].Close();
+			}
+		};
 
-			std::vector<std::vector<int> > train_samples;
-			std::vector<T> train_samples_scores;
+		for (size_t m = 0; m < model_num; ++m) {
+			for (size_t i = 0; i < num_threads_; ++i)
+				models_[m]->solvers[i].Reset(&models_[m]->param_server);
+		}
 
-			while (LoadBatchSamples(file_parser,train_samples_scores,train_samples,batch_size) ) {
-				double local_mse = 0.;
-				for(int j = 0;j < train_samples.size();j++)
-					local_mse += solvers[i].Update(train_samples_scores[j],train_samples[j],&param_server_);
-
-				local_count = batch_size;
-				{
-					std::lock_guard<SpinLock> lockguard(lock);
-					count += local_count;
-					rmse += local_mse;
-					if (count % DEFAULT_BATCH_SIZE == 0){
-						fprintf(stdout,"epoch=%zu processed=[%lld],avg rmse is [%f] \r",iter,count,sqrt(rmse / count) );
-						fflush(stdout);
+		//all workers train one block at a time, so only its user rows and item rows need to be
+		//resident. item blocks snake across user blocks so each user block starts on the
+		//item block already in memory
+		auto train_blocks = [&] () {
+			const size_t blocks = option_.row_blocks;
+			size_t cur_b = blocks, cur_c = blocks;
+			for (size_t b = 0; b < blocks; ++b) {
+				for (size_t s = 0; s < blocks; ++s) {
+					size_t c = b % 2 == 0 ? s : blocks - 1 - s;
+					for (size_t m = 0; m < model_num; ++m) {
+						MFParamServer<T>& ps = models_[m]->param_server;
+						if (b != cur_b) {
+							if (cur_b < blocks) ps.EvictRows(BlockBegin(user_num_, cur_b), BlockBegin(user_num_, cur_b + 1));
+							ps.PrefetchRows(BlockBegin(user_num_, b), BlockBegin(user_num_, b + 1));
+						}
+						if (c != cur_c) {
+							if (cur_c < blocks) ps.EvictRows(user_num_ + BlockBegin(item_num_, cur_c),
+								user_num_ + BlockBegin(item_num_, cur_c + 1));
+							ps.PrefetchRows(user_num_ + BlockBegin(item_num_, c), user_num_ + BlockBegin(item_num_, c + 1));
+						}
 					}
+					cur_b = b;
+					cur_c = c;
+					shard_files = &block_lists[b * blocks + c];
+					util_parallel_run(worker_func, num_threads_);
 				}
-				train_samples.clear(); 
-				train_samples_scores.clear(); 
 			}
-        solvers[i].PushParam(&param_server_);
-		file_parser.CloseFile();
+			shard_files = &split_train_list;
+		};
+
+		if (out_of_core) {
+			train_blocks();
+		} else if (option_.user_shard) {
+			for (size_t w = 0; w < num_threads_; ++w) queues[w].Reopen();
+			util_parallel_run(shard_func, 2 * num_threads_);
+		} else {
+			util_parallel_run(worker_func, num_threads_);
+		}
+		double elapsed = timer.StopTimer();
+		for (size_t m = 0; m < model_num; ++m) {
+			std::string valid;
+			if (option_.folds > 0) {
+				char buf[128];
+				snprintf(buf, sizeof(buf), ",valid %s is [%f] on %lld pairs", loss_name,
+					AvgLoss(models_[m]->valid_loss, models_[m]->valid_count), models_[m]->valid_count);
+				valid = buf;
+			}
+			fprintf(stdout,"%sepoch=%zu processed=[%lld],avg %s is [%f]%s, elapsed %.1fs\n",
+				model_tag(m).c_str(), iter, count, loss_name, AvgLoss(models_[m]->loss, models_[m]->pairs),
+				valid.c_str(), elapsed);
+		}
+		if (option_.pin_threads) {
+			size_t local = 0, remote = 0;
+			for (size_t m = 0; m < model_num; ++m) {
+				for (size_t i = 0; i < num_threads_; ++i) {
+					size_t l, r;
+					models_[m]->solvers[i].TakeAccessStats(l, r);
+					local += l;
+					remote += r;
+				}
+			}
+			fprintf(stdout,"epoch=%zu numa local access ratio is [%f], local=%zu remote=%zu\n",
+				iter, static_cast<double>(local) / std::max<size_t>(1, local + remote), local, remote);
+		}
 
-	};
-		for (size_t i = 0; i < num_threads_; ++i) {
-			solvers[i].Reset(&param_server_);
+		if (option_.checkpoint_step > 0 && (iter + 1) % option_.checkpoint_step == 0 && iter + 1 < epoch_) {
+			for (size_t m = 0; m < model_num; ++m) {
+				StopWatch save_timer;
+				if (SaveCheckpoint(m)) {
+					fprintf(stdout, "%scheckpoint epoch=%zu saved to %s.ckpt in %.1fs\n", model_tag(m).c_str(),
+						iter, models_[m]->model_file.c_str(), save_timer.StopTimer());
+				} else {
+					fprintf(stdout, "%scheckpoint epoch=%zu to %s.ckpt failed\n", model_tag(m).c_str(),
+						iter, models_[m]->model_file.c_str());
+					ok = false;
+				}
+			}
 		}
 
-		util_parallel_run(worker_func, num_threads_);
+		if (validate) {
+			//the previous epoch was scored while this one trained
+			bool stop = collect_validation();
+			for (size_t m = 0; m < model_num; ++m) models_[m]->param_server.FlushDecay();
+			validator.Start(servers, iter, num_threads_);
+			if (stop) {
+				fprintf(stdout, "no validation improvement for %zu epochs, stop\n", option_.early_stop);
+				break;
+			}
+		}
 	}
-
-	delete [] solvers;
-	return param_server_.SaveModelAll(model_file);
+	if (validate) collect_validation();
+
+	for (size_t m = 0; m < model_num; ++m) {
+		MFParamServer<T>& ps = models_[m]->param_server;
+		ps.FlushDecay();
+		if (option_.early_stop > 0 && validator.RestoreBest(m, &ps, num_threads_)) {
+			fprintf(stdout, "%ssave the best epoch=%zu, valid rmse is [%f]\n", model_tag(m).c_str(),
+				validator.best_epoch(m), validator.best_rmse(m));
+		}
+		if (!ps.SaveModelAll(models_[m]->model_file.c_str())) ok = false;
+	}
+	models_.clear();
+	for (size_t m = 0; out_of_core && m < model_num; ++m) std::remove(StoreFile(m).c_str());
+	for (size_t k = 0; k < block_lists.size(); ++k) {
+		for (size_t i = 0; i < block_lists[k].size(); ++i) {
+			std::remove(BlockFile(k, i).c_str());
+			std::remove(block_lists[k][i].c_str());
+		}
+	}
+	return ok;
+}
+template<typename T>
+bool FastMFTrainer<T>::SaveCheckpoint(size_t m) {
+	MFParamServer<T>& ps = models_[m]->param_server;
+	std::string path = models_[m]->model_file + ".ckpt";
+	std::string tmp = path + ".tmp";
+	ps.FlushDecay();
+	//binary whatever --model-format says, a text dump would round the rows it resumes from
+	const bool binary = ps.binary_model();
+	ps.SetBinaryModel(true);
+	const bool saved = ps.SaveModel(tmp.c_str());
+	ps.SetBinaryModel(binary);
+	if (!saved) return false;
+	if (ps.dynamic_ids() && std::rename((tmp + ".ids").c_str(), (path + ".ids").c_str()) != 0) return false;
+	return std::rename(tmp.c_str(), path.c_str()) == 0;
 }
+
 template<typename T>
 FastMFTrainer<T>::FastMFTrainer()
 : epoch_(0), push_step_(0),
-fetch_step_(0), param_server_(), num_threads_(0), init_(false),user_num_(0),item_num_(0) { }
+fetch_step_(0), num_threads_(0), init_(false),user_num_(0),item_num_(0) { }
 
 template<typename T>
 FastMFTrainer<T>::~FastMFTrainer() {
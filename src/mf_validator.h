@@ -0,0 +1,186 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef SRC_MF_VALIDATOR_H
+#define SRC_MF_VALIDATOR_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "src/file_parser.h"
+#include "src/lock.h"
+#include "src/mf_solver.h"
+#include "src/util.h"
+
+//scores a held out file list against snapshots of the models while training goes on.
+//every model has two buffers: the snapshot under evaluation and the best snapshot so
+//far, an improving snapshot just swaps with the best one
+template<typename T>
+class MFValidator {
+public:
+	MFValidator() : num_threads_(0), user_num_(0), feat_num_(0), running_(false), epoch_(0) {}
+	~MFValidator() { Join(); }
+
+	bool Initialize(const char* valid_file, size_t num_threads, size_t model_num) {
+		//own shard names, the valid list may be the training list itself
+		split_trainfiles(valid_file, valid_list_, num_threads, 0, ".valid");
+		if (valid_list_.empty()) return false;
+		num_threads_ = valid_list_.size();
+		models_.assign(model_num, Snapshot());
+		return true;
+	}
+
+	//copy the rows of every model, then evaluate the copies on a background thread.
+	//the models must not be updated during the copy
+	void Start(const std::vector<MFSolver<T>*>& models, size_t epoch, size_t copy_threads) {
+		Join();
+		user_num_ = models[0]->user_num();
+		feat_num_ = models[0]->feat_num();
+		for (size_t m = 0; m < models_.size(); ++m) {
+			Snapshot& s = models_[m];
+			MFSolver<T>* model = models[m];
+			s.l_dim = model->l_dim();
+			s.current.resize(feat_num_ * s.l_dim);
+			auto copy_row = [&] (size_t i) {
+				memcpy(&s.current[i * s.l_dim], model->row(i), s.l_dim * sizeof(T));
+			};
+			util_parallel_for(feat_num_, copy_row, copy_threads);
+		}
+		epoch_ = epoch;
+		running_ = true;
+		thread_ = std::thread(&MFValidator<T>::Evaluate, this);
+	}
+
+	//wait for the running evaluation, false if there was none. rmse holds the
+	//score of every model and improved whether it beat that model's best so far
+	bool Wait(size_t& epoch, std::vector<double>& rmse, std::vector<char>& improved) {
+		if (!running_) return false;
+		Join();
+		epoch = epoch_;
+		rmse.resize(models_.size());
+		improved.resize(models_.size());
+		for (size_t m = 0; m < models_.size(); ++m) {
+			Snapshot& s = models_[m];
+			rmse[m] = s.rmse;
+			improved[m] = s.rmse < s.best_rmse;
+			if (improved[m]) {
+				s.best_rmse = s.rmse;
+				s.best_epoch = epoch_;
+				s.current.swap(s.best);
+			}
+		}
+		return true;
+	}
+
+	size_t best_epoch(size_t m) const { return models_[m].best_epoch; }
+	double best_rmse(size_t m) const { return models_[m].best_rmse; }
+
+	//write the best snapshot of model m back into its rows
+	bool RestoreBest(size_t m, MFSolver<T>* model, size_t copy_threads) {
+		const Snapshot& s = models_[m];
+		if (s.best.empty()) return false;
+		auto copy_row = [&] (size_t i) {
+			memcpy(model->row(i), &s.best[i * s.l_dim], s.l_dim * sizeof(T));
+		};
+		util_parallel_for(feat_num_, copy_row, copy_threads);
+		return true;
+	}
+
+private:
+	struct Snapshot {
+		int l_dim;
+		std::vector<T> current;
+		std::vector<T> best;
+		double rmse;
+		double best_rmse;
+		size_t best_epoch;
+
+		Snapshot() : l_dim(0), rmse(0.), best_rmse(std::numeric_limits<double>::max()), best_epoch(0) {}
+	};
+
+	void Join() {
+		if (thread_.joinable()) thread_.join();
+		running_ = false;
+	}
+
+	//pair level rmse of every snapshot, one pass over the files for all of them
+	void Evaluate() {
+		const size_t model_num = models_.size();
+		std::vector<double> sse(model_num, 0.);
+		size_t pairs = 0;
+		SpinLock lock;
+		auto eval_func = [&] (size_t t) {
+			FileParser<typename compute_type<T>::type> parser;
+			if (!parser.OpenFile(valid_list_[t].c_str())) return;
+			std::vector<double> local_sse(model_num, 0.);
+			size_t local_pairs = 0;
+			typename compute_type<T>::type score;
+			std::vector<mf_id_t> x;
+			while (parser.ReadSample(score, x)) {
+				if (x.size() < 2 || x[0] < 0 || static_cast<size_t>(x[0]) >= user_num_) continue;
+				for (size_t j = 1; j < x.size(); ++j) {
+					size_t item = x[j] + user_num_;
+					if (x[j] < 0 || item >= feat_num_) break;
+					for (size_t m = 0; m < model_num; ++m) {
+						const Snapshot& s = models_[m];
+						const T* u = &s.current[x[0] * s.l_dim];
+						const T* v = &s.current[item * s.l_dim];
+						double err = -score;
+						for (int l = 0; l < s.l_dim; ++l) err += u[l] * v[l];
+						local_sse[m] += err * err;
+					}
+					++local_pairs;
+				}
+			}
+			parser.CloseFile();
+
+			std::lock_guard<SpinLock> lockguard(lock);
+			for (size_t m = 0; m < model_num; ++m) sse[m] += local_sse[m];
+			pairs += local_pairs;
+		};
+		//plain threads, not the pool: the next epoch trains on the pool while this runs, and a
+		//busy pool would hand the trainer fresh unpinned threads
+		std::vector<std::thread> threads;
+		for (size_t t = 0; t < num_threads_; ++t) threads.push_back(std::thread(eval_func, t));
+		for (size_t t = 0; t < num_threads_; ++t) threads[t].join();
+
+		for (size_t m = 0; m < model_num; ++m)
+			models_[m].rmse = sqrt(sse[m] / std::max<size_t>(1, pairs));
+	}
+
+	std::vector<std::string> valid_list_;
+	size_t num_threads_;
+	size_t user_num_;
+	size_t feat_num_;
+	std::vector<Snapshot> models_;
+
+	std::thread thread_;
+	bool running_;
+	size_t epoch_;
+};
+
+#endif // SRC_MF_VALIDATOR_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
@@ -0,0 +1,456 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef SRC_MODEL_IO_H
+#define SRC_MODEL_IO_H
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "src/reduced_float.h"
+#include "src/util.h"
+
+//model files come in two formats. text is "user_num\nitem_num\nl_dim\n" then one row per
+//line, tab separated with 8 decimals. binary is a fixed header followed by the raw rows:
+//
+//  [BinaryModelHeader][zero padding to data_offset][row 0][row 1]...[row n - 1]
+//
+//every row takes row_bytes, l_dim elements of dtype padded with zeros to kModelRowAlign
+//bytes. data_offset is page aligned so the rows can be mapped in place. all fields are
+//little endian, as written by the x86 hosts the trainer runs on
+enum ModelDType { kModelFp32 = 1, kModelFp64 = 2, kModelBf16 = 3, kModelFp16 = 4 };
+
+const char kModelMagic[8] = {'A', 'M', 'F', 'B', 'I', 'N', '\0', '\0'};
+const uint32_t kModelVersion = 1;
+const size_t kModelRowAlign = 16;
+const size_t kModelDataOffset = 4096;
+const size_t kModelChunkBytes = 4 << 20;	//rows a thread reads or writes in one go
+const size_t kTextChunkBytes = 1 << 20;	//about this much text is formatted by a thread in one go
+
+struct BinaryModelHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t dtype;			//ModelDType of the elements
+	uint64_t user_num;
+	uint64_t item_num;
+	uint32_t l_dim;
+	uint32_t row_bytes;		//row stride in the file
+	uint64_t data_offset;	//file offset of row 0
+	uint32_t data_crc;		//crc32 of the (user_num + item_num) * row_bytes data bytes
+	uint32_t header_crc;	//crc32 of the header bytes before this field
+
+	size_t rows() const { return user_num + item_num; }
+	uint64_t data_bytes() const { return rows() * row_bytes; }
+};
+
+template<typename T> struct model_dtype;
+template<> struct model_dtype<float> { enum { value = kModelFp32 }; };
+template<> struct model_dtype<double> { enum { value = kModelFp64 }; };
+template<> struct model_dtype<bf16> { enum { value = kModelBf16 }; };
+template<> struct model_dtype<fp16> { enum { value = kModelFp16 }; };
+
+inline size_t model_dtype_size(uint32_t dtype) {
+	switch (dtype) {
+	case kModelFp32: return 4;
+	case kModelFp64: return 8;
+	case kModelBf16: case kModelFp16: return 2;
+	default: return 0;
+	}
+}
+
+inline const char* model_dtype_name(uint32_t dtype) {
+	switch (dtype) {
+	case kModelFp32: return "fp32";
+	case kModelFp64: return "fp64";
+	case kModelBf16: return "bf16";
+	case kModelFp16: return "fp16";
+	default: return "unknown";
+	}
+}
+
+inline bool parse_model_dtype(const std::string& name, uint32_t& dtype) {
+	if (name == "fp32") dtype = kModelFp32;
+	else if (name == "fp64") dtype = kModelFp64;
+	else if (name == "bf16") dtype = kModelBf16;
+	else if (name == "fp16") dtype = kModelFp16;
+	else return false;
+	return true;
+}
+
+//element k of a row stored as dtype
+inline double model_decode(uint32_t dtype, const char* row, int k) {
+	switch (dtype) {
+	case kModelFp32: { float f; memcpy(&f, row + k * 4, 4); return f; }
+	case kModelFp64: { double d; memcpy(&d, row + k * 8, 8); return d; }
+	case kModelBf16: { uint16_t h; memcpy(&h, row + k * 2, 2); return bf16_to_float(h); }
+	case kModelFp16: { uint16_t h; memcpy(&h, row + k * 2, 2); return half_to_float(h); }
+	default: return 0.;
+	}
+}
+
+//dot product of two rows of elements E, accumulated in T
+template<typename E, typename T>
+inline T model_row_dot(const char* x, const char* y, int l_dim) {
+	const E* a = reinterpret_cast<const E*>(x);
+	const E* b = reinterpret_cast<const E*>(y);
+	T sum = 0;
+	for (int k = 0; k < l_dim; ++k) sum += static_cast<T>(a[k]) * static_cast<T>(b[k]);
+	return sum;
+}
+
+//dot product of two rows stored as dtype, for reading a mapped model in place
+template<typename T>
+inline T model_dot(uint32_t dtype, const char* x, const char* y, int l_dim) {
+	switch (dtype) {
+	case kModelFp32: return model_row_dot<float, T>(x, y, l_dim);
+	case kModelFp64: return model_row_dot<double, T>(x, y, l_dim);
+	case kModelBf16: return model_row_dot<bf16, T>(x, y, l_dim);
+	case kModelFp16: return model_row_dot<fp16, T>(x, y, l_dim);
+	default: return 0;
+	}
+}
+
+inline size_t model_row_bytes(uint32_t dtype, int l_dim) {
+	size_t bytes = model_dtype_size(dtype) * l_dim;
+	return (bytes + kModelRowAlign - 1) / kModelRowAlign * kModelRowAlign;
+}
+
+inline uint32_t model_header_crc(const BinaryModelHeader& h) {
+	return crc32(0L, reinterpret_cast<const Bytef*>(&h), offsetof(BinaryModelHeader, header_crc));
+}
+
+inline bool model_pwrite(int fd, const char* buf, size_t n, uint64_t off) {
+	while (n > 0) {
+		ssize_t w = pwrite(fd, buf, n, off);
+		if (w <= 0) return false;
+		buf += w; n -= w; off += w;
+	}
+	return true;
+}
+
+inline bool model_pread(int fd, char* buf, size_t n, uint64_t off) {
+	while (n > 0) {
+		ssize_t r = pread(fd, buf, n, off);
+		if (r <= 0) return false;
+		buf += r; n -= r; off += r;
+	}
+	return true;
+}
+
+//true when path starts with the binary model magic
+inline bool is_binary_model(const char* path) {
+	char magic[sizeof(kModelMagic)];
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+	bool ok = model_pread(fd, magic, sizeof(magic), 0) && memcmp(magic, kModelMagic, sizeof(magic)) == 0;
+	close(fd);
+	return ok;
+}
+
+//read and check the header of a binary model, false with a message when it is not one
+inline bool read_binary_model_header(const char* path, BinaryModelHeader& h) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	bool ok = fstat(fd, &st) == 0 && model_pread(fd, reinterpret_cast<char*>(&h), sizeof(h), 0);
+	close(fd);
+	if (!ok || memcmp(h.magic, kModelMagic, sizeof(kModelMagic)) != 0) return false;
+	if (h.version != kModelVersion || h.header_crc != model_header_crc(h)) {
+		printf("model %s: unsupported version or corrupt header\n", path);
+		return false;
+	}
+	if (model_dtype_size(h.dtype) == 0 || h.l_dim == 0 || h.row_bytes < model_dtype_size(h.dtype) * h.l_dim
+			|| static_cast<uint64_t>(st.st_size) < h.data_offset + h.data_bytes()) {
+		printf("model %s: bad layout or truncated\n", path);
+		return false;
+	}
+	return true;
+}
+
+//write rows [0, user_num + item_num) as a binary model of dtype model_dtype<T>, row(i) returns
+//the l_dim elements of row i. chunks of rows are copied out, checksummed and written with
+//pwrite by num_threads threads (0 uses every cpu), the chunk crcs are combined at the end
+template<typename T, typename RowFunc>
+bool write_binary_model(const char* path, size_t user_num, size_t item_num, int l_dim,
+		const RowFunc& row, size_t num_threads) {
+	BinaryModelHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, kModelMagic, sizeof(kModelMagic));
+	h.version = kModelVersion;
+	h.dtype = model_dtype<T>::value;
+	h.user_num = user_num;
+	h.item_num = item_num;
+	h.l_dim = l_dim;
+	h.row_bytes = model_row_bytes(h.dtype, l_dim);
+	h.data_offset = kModelDataOffset;
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return false;
+	if (ftruncate(fd, h.data_offset + h.data_bytes()) != 0) {
+		close(fd);
+		return false;
+	}
+
+	const size_t n = h.rows();
+	const size_t chunk_rows = std::max<size_t>(1, kModelChunkBytes / h.row_bytes);
+	const size_t chunk_num = (n + chunk_rows - 1) / chunk_rows;
+	std::vector<uint32_t> crcs(chunk_num);
+	std::atomic<bool> ok(true);
+	auto write_chunk = [&] (size_t c) {
+		static thread_local std::vector<char> buf;
+		size_t begin = c * chunk_rows, end = std::min(n, begin + chunk_rows);
+		buf.assign((end - begin) * h.row_bytes, 0);
+		for (size_t i = begin; i < end; ++i)
+			memcpy(&buf[(i - begin) * h.row_bytes], row(i), l_dim * sizeof(T));
+		crcs[c] = crc32(0L, reinterpret_cast<const Bytef*>(buf.data()), buf.size());
+		if (!model_pwrite(fd, buf.data(), buf.size(), h.data_offset + begin * h.row_bytes)) ok = false;
+	};
+	util_parallel_for(chunk_num, write_chunk, num_threads);
+
+	h.data_crc = crc32(0L, Z_NULL, 0);
+	for (size_t c = 0; c < chunk_num; ++c) {
+		size_t rows = std::min(n, (c + 1) * chunk_rows) - c * chunk_rows;
+		h.data_crc = crc32_combine(h.data_crc, crcs[c], rows * h.row_bytes);
+	}
+	h.header_crc = model_header_crc(h);
+	if (!model_pwrite(fd, reinterpret_cast<const char*>(&h), sizeof(h), 0)) ok = false;
+	if (close(fd) != 0) ok = false;
+	return ok;
+}
+
+//fill row(i), l_dim writable elements of T, for every row of the binary model at path
+//whose header is h. elements of another dtype are converted. the data crc is checked
+template<typename T, typename RowFunc>
+bool read_binary_model(const char* path, const BinaryModelHeader& h, const RowFunc& row, size_t num_threads) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+
+	const size_t n = h.rows();
+	const size_t chunk_rows = std::max<size_t>(1, kModelChunkBytes / h.row_bytes);
+	const size_t chunk_num = (n + chunk_rows - 1) / chunk_rows;
+	const bool same_dtype = h.dtype == static_cast<uint32_t>(model_dtype<T>::value);
+	std::vector<uint32_t> crcs(chunk_num);
+	std::atomic<bool> ok(true);
+	auto read_chunk = [&] (size_t c) {
+		static thread_local std::vector<char> buf;
+		size_t begin = c * chunk_rows, end = std::min(n, begin + chunk_rows);
+		buf.resize((end - begin) * h.row_bytes);
+		if (!model_pread(fd, buf.data(), buf.size(), h.data_offset + begin * h.row_bytes)) {
+			ok = false;
+			return;
+		}
+		crcs[c] = crc32(0L, reinterpret_cast<const Bytef*>(buf.data()), buf.size());
+		for (size_t i = begin; i < end; ++i) {
+			const char* src = &buf[(i - begin) * h.row_bytes];
+			T* dst = row(i);
+			if (same_dtype) {
+				memcpy(dst, src, h.l_dim * sizeof(T));
+			} else {
+				for (uint32_t k = 0; k < h.l_dim; ++k) dst[k] = static_cast<T>(model_decode(h.dtype, src, k));
+			}
+		}
+	};
+	util_parallel_for(chunk_num, read_chunk, num_threads);
+	close(fd);
+	if (!ok) return false;
+
+	uint32_t crc = crc32(0L, Z_NULL, 0);
+	for (size_t c = 0; c < chunk_num; ++c) {
+		size_t rows = std::min(n, (c + 1) * chunk_rows) - c * chunk_rows;
+		crc = crc32_combine(crc, crcs[c], rows * h.row_bytes);
+	}
+	if (crc != h.data_crc) {
+		printf("model %s: checksum mismatch\n", path);
+		return false;
+	}
+	return true;
+}
+
+//user, item and dim counts of the text or binary model at path
+inline bool read_model_shape(const char* path, size_t& user_num, size_t& item_num, int& l_dim) {
+	BinaryModelHeader h;
+	if (read_binary_model_header(path, h)) {
+		user_num = h.user_num;
+		item_num = h.item_num;
+		l_dim = h.l_dim;
+		return true;
+	}
+	if (is_binary_model(path)) return false;
+	std::ifstream fin(path);
+	return fin.is_open() && (fin >> user_num >> item_num >> l_dim) && l_dim > 0;
+}
+
+//read every row of the text or binary model at path, whose dim must be l_dim, into
+//dst(user, k): the T* row to fill for user k (user true) or item k, NULL skips the row.
+//binary models are read by num_threads threads, dst must be safe to call concurrently
+template<typename T, typename DstFunc>
+bool load_model_rows(const char* path, int l_dim, const DstFunc& dst, size_t num_threads) {
+	size_t user_num = 0, item_num = 0;
+	int dim = 0;
+	if (!read_model_shape(path, user_num, item_num, dim)) return false;
+	if (dim != l_dim) {
+		printf("model %s has dim %d, expected %d\n", path, dim, l_dim);
+		return false;
+	}
+
+	BinaryModelHeader h;
+	if (read_binary_model_header(path, h)) {
+		auto row = [&] (size_t i) -> T* {
+			T* x = i < user_num ? dst(true, i) : dst(false, i - user_num);
+			if (x != NULL) return x;
+			static thread_local std::vector<T> skip;
+			skip.resize(l_dim);
+			return skip.data();
+		};
+		return read_binary_model<T>(path, h, row, num_threads);
+	}
+
+	std::ifstream fin(path);
+	fin >> user_num >> item_num >> dim;
+	std::vector<double> x(l_dim);
+	for (size_t i = 0; i < user_num + item_num; ++i) {
+		for (int k = 0; k < l_dim; ++k) {
+			if (!(fin >> x[k])) return false;
+		}
+		T* row = i < user_num ? dst(true, i) : dst(false, i - user_num);
+		if (row == NULL) continue;
+		for (int k = 0; k < l_dim; ++k) row[k] = static_cast<T>(x[k]);
+	}
+	return true;
+}
+
+//write v at p as printf("%.8f") does, which is what std::fixed << std::setprecision(8)
+//prints, and return the end. below 1e10 the value is scaled by 1e8 and rounded half to
+//even exactly in 128 bit integers, larger values, inf and nan go through snprintf
+inline char* format_fixed8(double v, char* p) {
+	uint64_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	int exp = static_cast<int>((bits >> 52) & 0x7ff);
+	if (exp == 0x7ff || std::fabs(v) >= 1e10) return p + snprintf(p, 512, "%.8f", v);
+	if (bits >> 63) *p++ = '-';
+	uint64_t mant = bits & ((1ULL << 52) - 1);
+	if (exp == 0) exp = 1;
+	else mant |= 1ULL << 52;
+
+	//|v| = mant * 2^-shift, shift > 18 since |v| < 2^34
+	int shift = 1075 - exp;
+	unsigned __int128 x = static_cast<unsigned __int128>(mant) * 100000000u;
+	uint64_t scaled = 0;
+	if (shift < 81) {	//otherwise x < 2^80 rounds to 0
+		unsigned __int128 q = x >> shift;
+		unsigned __int128 rem = x - (q << shift);
+		unsigned __int128 half = static_cast<unsigned __int128>(1) << (shift - 1);
+		if (rem > half || (rem == half && (q & 1))) ++q;
+		scaled = static_cast<uint64_t>(q);
+	}
+
+	uint64_t int_part = scaled / 100000000u;
+	uint32_t frac = static_cast<uint32_t>(scaled % 100000000u);
+	char digits[20];
+	int n = 0;
+	do {
+		digits[n++] = static_cast<char>('0' + int_part % 10);
+		int_part /= 10;
+	} while (int_part > 0);
+	while (n > 0) *p++ = digits[--n];
+	*p++ = '.';
+	for (int k = 7; k >= 0; --k) {
+		p[k] = static_cast<char>('0' + frac % 10);
+		frac /= 10;
+	}
+	return p + 8;
+}
+
+//write rows as a text model, row(i) as for write_binary_model. rounds of chunks are
+//formatted into per chunk buffers by num_threads threads (0 uses every cpu), then
+//written in order with large writes
+template<typename T, typename RowFunc>
+bool write_text_model(const char* path, size_t user_num, size_t item_num, int l_dim,
+		const RowFunc& row, size_t num_threads) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return false;
+	if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+
+	char head[64];
+	int head_len = snprintf(head, sizeof(head), "%zu\n%zu\n%d\n", user_num, item_num, l_dim);
+	uint64_t off = 0;
+	bool ok = model_pwrite(fd, head, head_len, off);
+	off += head_len;
+
+	const size_t n = user_num + item_num;
+	const size_t chunk_rows = std::max<size_t>(1, kTextChunkBytes / (12 * l_dim));
+	const size_t round_chunks = num_threads * 4;
+	std::vector<std::string> bufs(round_chunks);
+	for (size_t first = 0; ok && first < n; first += round_chunks * chunk_rows) {
+		auto format_chunk = [&] (size_t c) {
+			std::string& buf = bufs[c];
+			size_t begin = first + c * chunk_rows, end = std::min(n, begin + chunk_rows);
+			size_t len = 0;
+			for (size_t i = begin; i < end; ++i) {
+				const T* x = row(i);
+				for (int j = 0; j < l_dim; ++j) {
+					if (buf.size() < len + 512) buf.resize(2 * buf.size() + 512);
+					char* p = format_fixed8(static_cast<double>(x[j]), &buf[len]);
+					*p++ = j + 1 < l_dim ? '\t' : '\n';
+					len = p - buf.data();
+				}
+			}
+			buf.resize(len);
+		};
+		size_t chunks = std::min(round_chunks, (n - first + chunk_rows - 1) / chunk_rows);
+		util_parallel_for(chunks, format_chunk, num_threads);
+		for (size_t c = 0; ok && c < chunks; ++c) {
+			ok = model_pwrite(fd, bufs[c].data(), bufs[c].size(), off);
+			off += bufs[c].size();
+		}
+	}
+	if (close(fd) != 0) ok = false;
+	return ok;
+}
+
+//read a text model into data, row i at data[i * l_dim]
+template<typename T>
+bool read_text_model(const char* path, size_t& user_num, size_t& item_num, int& l_dim, std::vector<T>& data) {
+	std::ifstream fin(path);
+	if (!fin.is_open()) return false;
+	fin >> user_num >> item_num >> l_dim;
+	if (!fin || l_dim <= 0) return false;
+	data.resize((user_num + item_num) * l_dim);
+	for (size_t k = 0; k < data.size(); ++k) {
+		if (!(fin >> data[k])) return false;
+	}
+	return true;
+}
+
+#endif // SRC_MODEL_IO_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
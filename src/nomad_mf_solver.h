@@ -0,0 +1,173 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_NOMAD_MF_SOLVER_H
+#define SRC_NOMAD_MF_SOLVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+#include "src/mf_solver.h"
+#include "src/rating_matrix.h"
+#include "src/spsc_queue.h"
+#include "src/stopwatch.h"
+#include "src/util.h"
+
+//NOMAD: users are statically partitioned over the workers and every item row
+//circulates as a token through a ring of lock free queues, so each row is
+//only ever written by the single worker that currently owns it
+template<typename T>
+class NomadMFSolver : public MFSolver<T> {
+public:
+	NomadMFSolver() : MFSolver<T>(), num_threads_(0) {}
+	virtual ~NomadMFSolver() {}
+
+	bool Train(const char* train_file, size_t epoch, size_t num_threads);
+
+private:
+	struct ItemToken {
+		int item;
+		int visits;
+	};
+
+	void PartitionUsers(const RatingMatrix<T>& by_user);
+	double ProcessColumn(size_t worker, int item);
+
+	size_t num_threads_;
+	std::vector<size_t> user_split_;	//worker w owns users [user_split_[w], user_split_[w + 1])
+	std::vector<size_t> col_split_;		//per item, where each worker's users start in its column
+	RatingMatrix<T> by_item_;
+};
+
+//contiguous user ranges holding roughly the same number of ratings
+template<typename T>
+void NomadMFSolver<T>::PartitionUsers(const RatingMatrix<T>& by_user) {
+	size_t user_num = by_user.row_num();
+	user_split_.assign(num_threads_ + 1, user_num);
+	user_split_[0] = 0;
+	size_t w = 1;
+	for (size_t u = 0; u < user_num && w < num_threads_; ++u) {
+		if (by_user.row_begin(u) * num_threads_ >= w * by_user.nnz())
+			user_split_[w++] = u;
+	}
+	for (; w < num_threads_; ++w) user_split_[w] = user_num;
+}
+
+template<typename T>
+double NomadMFSolver<T>::ProcessColumn(size_t worker, int item) {
+	T** u = MFSolver<T>::u_;
+	const T alpha = MFSolver<T>::alpha_;
+	const T l2 = MFSolver<T>::l2_;
+	const int l_dim = MFSolver<T>::l_dim_;
+
+	T* v = u[MFSolver<T>::user_num_ + item];
+	size_t begin = col_split_[item * (num_threads_ + 1) + worker];
+	size_t end = col_split_[item * (num_threads_ + 1) + worker + 1];
+	double sse = 0.;
+	for (size_t k = begin; k < end; ++k) {
+		T* w = u[by_item_.col(k)];
+		float ruv = 0.;
+		for (int l = 0; l < l_dim; ++l)
+			ruv += w[l] * v[l];
+		float obj_grad = ruv - by_item_.val(k);
+		sse += obj_grad * obj_grad;
+		for (int l = 0; l < l_dim; ++l) {
+			T wl = w[l];
+			w[l] -= alpha * (obj_grad * v[l] + l2 * wl);
+			v[l] -= alpha * (obj_grad * wl + l2 * v[l]);
+		}
+	}
+	return sse;
+}
+
+template<typename T>
+bool NomadMFSolver<T>::Train(const char* train_file, size_t epoch, size_t num_threads) {
+	if (!MFSolver<T>::init_) return false;
+
+	num_threads_ = num_threads == 0 ? std::thread::hardware_concurrency() : num_threads;
+	size_t item_num = MFSolver<T>::item_num_;
+
+	{
+		RatingMatrix<T> by_user;
+		if (!by_user.Load(train_file, MFSolver<T>::user_num_, item_num, num_threads_))
+			return false;
+		PartitionUsers(by_user);
+		by_user.Transpose(by_item_);
+	}
+
+	//columns are sorted by user, so each worker's slice of a column is contiguous
+	col_split_.resize(item_num * (num_threads_ + 1));
+	const std::vector<int>& users = by_item_.cols();
+	for (size_t j = 0; j < item_num; ++j) {
+		for (size_t w = 0; w <= num_threads_; ++w) {
+			col_split_[j * (num_threads_ + 1) + w] = std::lower_bound(
+				users.begin() + by_item_.row_begin(j), users.begin() + by_item_.row_end(j),
+				static_cast<int>(user_split_[w])) - users.begin();
+		}
+	}
+
+	fprintf(stdout, "nomad params={alpha:%.4f, l2:%.4f, epoch:%zu, threads:%zu}\n",
+		static_cast<float>(MFSolver<T>::alpha_), static_cast<float>(MFSolver<T>::l2_),
+		epoch, num_threads_);
+
+	std::vector<SpscQueue<ItemToken> > queues(num_threads_);
+	StopWatch timer;
+	for (size_t iter = 0; iter < epoch; ++iter) {
+		for (size_t w = 0; w < num_threads_; ++w)
+			queues[w].Initialize(item_num);
+		for (size_t j = 0; j < item_num; ++j) {
+			ItemToken token = {static_cast<int>(j), 0};
+			queues[j % num_threads_].Push(token);
+		}
+
+		//a token retires for this epoch once it has visited every worker
+		std::atomic<size_t> retired(0);
+		std::vector<double> sse(num_threads_, 0.);
+		auto worker_func = [&] (size_t w) {
+			SpscQueue<ItemToken>& next = queues[(w + 1) % num_threads_];
+			double local_sse = 0.;
+			ItemToken token;
+			while (retired.load(std::memory_order_relaxed) < item_num) {
+				if (!queues[w].Pop(token)) {
+					std::this_thread::yield();
+					continue;
+				}
+				local_sse += ProcessColumn(w, token.item);
+				if (++token.visits == static_cast<int>(num_threads_))
+					retired.fetch_add(1, std::memory_order_relaxed);
+				else
+					next.Push(token);
+			}
+			sse[w] = local_sse;
+		};
+		util_parallel_run(worker_func, num_threads_);
+
+		double total = 0.;
+		for (size_t w = 0; w < num_threads_; ++w) total += sse[w];
+		fprintf(stdout, "epoch=%zu processed=[%zu],avg rmse is [%f], elapsed %.1fs\n",
+			iter, by_item_.nnz(), sqrt(total / std::max<size_t>(1, by_item_.nnz())), timer.StopTimer());
+	}
+	return true;
+}
+
+#endif // SRC_NOMAD_MF_SOLVER_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
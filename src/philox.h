@@ -0,0 +1,64 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef SRC_PHILOX_H
+#define SRC_PHILOX_H
+
+#include <cstdint>
+
+//Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3").
+//a counter based generator: the output is a pure function of (counter, key), so
+//any element can be drawn on any thread and the result never depends on the
+//thread count or the order of the draws
+struct Philox4x32 {
+	uint32_t v[4];
+
+	Philox4x32(uint64_t counter_hi, uint64_t counter_lo, uint64_t key) {
+		uint32_t c0 = static_cast<uint32_t>(counter_lo);
+		uint32_t c1 = static_cast<uint32_t>(counter_lo >> 32);
+		uint32_t c2 = static_cast<uint32_t>(counter_hi);
+		uint32_t c3 = static_cast<uint32_t>(counter_hi >> 32);
+		uint32_t k0 = static_cast<uint32_t>(key);
+		uint32_t k1 = static_cast<uint32_t>(key >> 32);
+		for (int round = 0; round < 10; ++round) {
+			uint64_t p0 = static_cast<uint64_t>(0xD2511F53u) * c0;
+			uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57u) * c2;
+			uint32_t n0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+			uint32_t n2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+			c1 = static_cast<uint32_t>(p1);
+			c3 = static_cast<uint32_t>(p0);
+			c0 = n0;
+			c2 = n2;
+			k0 += 0x9E3779B9u;
+			k1 += 0xBB67AE85u;
+		}
+		v[0] = c0;
+		v[1] = c1;
+		v[2] = c2;
+		v[3] = c3;
+	}
+
+	//uniform on [0, 1) with 24 random bits, exact in float
+	static float to_unit(uint32_t x) { return (x >> 8) * (1.f / 16777216.f); }
+};
+
+#endif // SRC_PHILOX_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
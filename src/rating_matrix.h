@@ -0,0 +1,185 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_RATING_MATRIX_H
+#define SRC_RATING_MATRIX_H
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+#include "src/file_parser.h"
+#include "src/lock.h"
+#include "src/mf_solver.h"
+#include "src/util.h"
+
+//in memory compressed sparse rows of the training pairs, used by the batch engines
+template<typename T>
+class RatingMatrix {
+public:
+	RatingMatrix() : row_num_(0), col_num_(0) {}
+
+	//read every file shard in parallel and build the user major matrix
+	bool Load(const char* train_file, size_t user_num, size_t item_num, size_t num_threads);
+
+	//build the column major (item major) copy of this matrix, rows stay sorted inside each column
+	void Transpose(RatingMatrix<T>& out) const;
+
+	//sort every row by column and sum the values of repeated (row, col) pairs
+	void MergeDuplicates();
+
+	size_t row_num() const { return row_num_; }
+	size_t col_num() const { return col_num_; }
+	size_t nnz() const { return col_.size(); }
+
+	size_t row_begin(size_t r) const { return row_ptr_[r]; }
+	size_t row_end(size_t r) const { return row_ptr_[r + 1]; }
+	int col(size_t k) const { return col_[k]; }
+	T val(size_t k) const { return val_[k]; }
+
+	const std::vector<size_t>& row_ptr() const { return row_ptr_; }
+	const std::vector<int>& cols() const { return col_; }
+	const std::vector<T>& vals() const { return val_; }
+
+private:
+	struct Entry {
+		int row;
+		int col;
+		T val;
+	};
+
+	void Build(std::vector<std::vector<Entry> >& parts);
+
+	size_t row_num_;
+	size_t col_num_;
+	std::vector<size_t> row_ptr_;
+	std::vector<int> col_;
+	std::vector<T> val_;
+};
+
+template<typename T>
+bool RatingMatrix<T>::Load(const char* train_file, size_t user_num, size_t item_num, size_t num_threads) {
+	std::vector<std::string> split_train_list;
+	split_trainfiles(train_file,split_train_list,num_threads);
+	if (split_train_list.empty()) return false;
+
+	row_num_ = user_num;
+	col_num_ = item_num;
+
+	std::vector<std::vector<Entry> > parts(split_train_list.size());
+	auto load_func = [&] (size_t i) {
+		FileParser<T> file_parser;
+		if (!file_parser.OpenFile(split_train_list[i].c_str())) return;
+
+		T score;
+		std::vector<mf_id_t> x;
+		while (file_parser.ReadSample(score,x)) {
+			if (x.size() < 2 || x[0] < 0 || static_cast<size_t>(x[0]) >= user_num) continue;
+			for (size_t j = 1; j < x.size(); ++j) {
+				if (x[j] < 0 || static_cast<size_t>(x[j]) >= item_num) break;
+				Entry e = {static_cast<int>(x[0]), static_cast<int>(x[j]), score};
+				parts[i].push_back(e);
+			}
+		}
+		file_parser.CloseFile();
+	};
+	util_parallel_run(load_func, split_train_list.size());
+
+	Build(parts);
+	printf("rating matrix %zu x %zu, nnz %zu\n", row_num_, col_num_, nnz());
+	return nnz() > 0;
+}
+
+template<typename T>
+void RatingMatrix<T>::Build(std::vector<std::vector<Entry> >& parts) {
+	row_ptr_.assign(row_num_ + 1, 0);
+	for (size_t p = 0; p < parts.size(); ++p) {
+		for (size_t k = 0; k < parts[p].size(); ++k)
+			++row_ptr_[parts[p][k].row + 1];
+	}
+	for (size_t r = 0; r < row_num_; ++r)
+		row_ptr_[r + 1] += row_ptr_[r];
+
+	std::vector<size_t> pos(row_ptr_.begin(), row_ptr_.end() - 1);
+	col_.resize(row_ptr_[row_num_]);
+	val_.resize(row_ptr_[row_num_]);
+	for (size_t p = 0; p < parts.size(); ++p) {
+		for (size_t k = 0; k < parts[p].size(); ++k) {
+			const Entry& e = parts[p][k];
+			size_t at = pos[e.row]++;
+			col_[at] = e.col;
+			val_[at] = e.val;
+		}
+		std::vector<Entry>().swap(parts[p]);
+	}
+}
+
+template<typename T>
+void RatingMatrix<T>::Transpose(RatingMatrix<T>& out) const {
+	out.row_num_ = col_num_;
+	out.col_num_ = row_num_;
+	out.row_ptr_.assign(col_num_ + 1, 0);
+	for (size_t k = 0; k < col_.size(); ++k)
+		++out.row_ptr_[col_[k] + 1];
+	for (size_t c = 0; c < col_num_; ++c)
+		out.row_ptr_[c + 1] += out.row_ptr_[c];
+
+	std::vector<size_t> pos(out.row_ptr_.begin(), out.row_ptr_.end() - 1);
+	out.col_.resize(col_.size());
+	out.val_.resize(col_.size());
+	for (size_t r = 0; r < row_num_; ++r) {
+		for (size_t k = row_ptr_[r]; k < row_ptr_[r + 1]; ++k) {
+			size_t at = pos[col_[k]]++;
+			out.col_[at] = static_cast<int>(r);
+			out.val_[at] = val_[k];
+		}
+	}
+}
+
+template<typename T>
+void RatingMatrix<T>::MergeDuplicates() {
+	std::vector<std::pair<int, T> > row;
+	size_t out = 0;
+	for (size_t r = 0; r < row_num_; ++r) {
+		row.clear();
+		for (size_t k = row_ptr_[r]; k < row_ptr_[r + 1]; ++k)
+			row.push_back(std::make_pair(col_[k], val_[k]));
+		std::sort(row.begin(), row.end(),
+			[] (const std::pair<int, T>& a, const std::pair<int, T>& b) { return a.first < b.first; });
+
+		row_ptr_[r] = out;
+		for (size_t k = 0; k < row.size(); ++k) {
+			if (k > 0 && row[k].first == row[k - 1].first) {
+				val_[out - 1] += row[k].second;
+				continue;
+			}
+			col_[out] = row[k].first;
+			val_[out] = row[k].second;
+			++out;
+		}
+	}
+	row_ptr_[row_num_] = out;
+	col_.resize(out);
+	val_.resize(out);
+}
+
+#endif // SRC_RATING_MATRIX_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
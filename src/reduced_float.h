@@ -0,0 +1,136 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef SRC_REDUCED_FLOAT_H
+#define SRC_REDUCED_FLOAT_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "src/half.h"
+
+//bfloat16 is the top half of a binary32, round to nearest even
+inline uint16_t float_to_bf16(float f) {
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	if ((x & 0x7fffffff) > 0x7f800000) return static_cast<uint16_t>((x >> 16) | 0x40); //quiet nan
+	x += 0x7fff + ((x >> 16) & 1);
+	return static_cast<uint16_t>(x >> 16);
+}
+
+inline float bf16_to_float(uint16_t h) {
+	uint32_t x = static_cast<uint32_t>(h) << 16;
+	float f;
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+//per thread xorshift32, the noise of stochastic rounding needs no quality beyond
+//being uniform and uncorrelated with the values
+inline uint32_t rounding_noise() {
+	static thread_local uint32_t state = 0x9e3779b9u ^ static_cast<uint32_t>(
+		reinterpret_cast<uintptr_t>(&state) >> 4);
+	uint32_t x = state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	state = x;
+	return x;
+}
+
+struct Bf16Codec {
+	static uint16_t Encode(float f) { return float_to_bf16(f); }
+	static float Decode(uint16_t h) { return bf16_to_float(h); }
+	//round up with probability equal to the dropped fraction, so E[Decode] == f
+	static uint16_t EncodeStochastic(float f) {
+		uint32_t x;
+		memcpy(&x, &f, sizeof(x));
+		if ((x & 0x7fffffff) >= 0x7f800000) return Encode(f);
+		x += rounding_noise() & 0xffff;
+		return static_cast<uint16_t>(x >> 16);
+	}
+};
+
+struct Fp16Codec {
+	static uint16_t Encode(float f) { return float_to_half(f); }
+	static float Decode(uint16_t h) { return half_to_float(h); }
+	//pick between the nearest half and its neighbour on the far side of f with
+	//probability by distance, which also covers subnormals and the sign change at 0
+	static uint16_t EncodeStochastic(float f) {
+		uint16_t h = float_to_half(f);
+		float g = half_to_float(h);
+		if (g == f || (h & 0x7fff) >= 0x7c00 || f != f) return h;
+		uint16_t sign = f < 0 ? 0x8000 : 0;
+		uint16_t mag = h & 0x7fff;
+		uint16_t next = static_cast<uint16_t>(sign | (std::fabs(f) > std::fabs(g) ? mag + 1 : mag - 1));
+		float gn = half_to_float(next);
+		float p = (f - g) / (gn - g);
+		return (rounding_noise() >> 8) * (1.f / 16777216.f) < p ? next : h;
+	}
+};
+
+//16 bit storage for model rows. loads widen to float and all arithmetic on the
+//value runs in float, plain stores round to nearest and the accumulating stores
+//(+=, -=, *=) used for sgd steps round stochastically so that updates far below
+//one ulp still move the row on average
+template<typename Codec>
+class ReducedFloat {
+public:
+	ReducedFloat() {}
+	ReducedFloat(float f) : bits_(Codec::Encode(f)) {}
+
+	operator float() const { return Codec::Decode(bits_); }
+
+	ReducedFloat& operator+=(float d) {
+		bits_ = Codec::EncodeStochastic(Codec::Decode(bits_) + d);
+		return *this;
+	}
+	ReducedFloat& operator-=(float d) {
+		bits_ = Codec::EncodeStochastic(Codec::Decode(bits_) - d);
+		return *this;
+	}
+	ReducedFloat& operator*=(float d) {
+		bits_ = Codec::EncodeStochastic(Codec::Decode(bits_) * d);
+		return *this;
+	}
+
+	uint16_t bits() const { return bits_; }
+
+private:
+	uint16_t bits_;
+};
+
+typedef ReducedFloat<Bf16Codec> bf16;
+typedef ReducedFloat<Fp16Codec> fp16;
+
+//the type solvers compute in for a storage type
+template<typename T>
+struct compute_type {
+	typedef T type;
+};
+
+template<typename Codec>
+struct compute_type<ReducedFloat<Codec> > {
+	typedef float type;
+};
+
+#endif // SRC_REDUCED_FLOAT_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
@@ -0,0 +1,233 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef SRC_ROW_MAP_H
+#define SRC_ROW_MAP_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "src/arena.h"
+#include "src/lock.h"
+#include "src/util.h"
+
+//sharded open addressing map from raw 64 bit ids to dense row indices. inserts take the
+//spin lock of their shard, probe linearly and double the shard table at 3/4 load; Find
+//takes no lock. a slot is published by storing its row after its id and a grown table
+//is published whole, so a reader sees a complete entry or none. replaced tables are kept
+//for readers still probing them until the map is destroyed, at most as much again as
+//the live tables. a Find racing the insert of its id may miss it, FindOrInsert does not
+class ConcurrentRowMap {
+public:
+	enum { kShardBits = 8, kShards = 1 << kShardBits };
+	static const uint64_t kNoRow = ~0ULL;
+
+	ConcurrentRowMap() : shards_(new Shard[kShards]) {}
+
+	//presize for about n ids
+	void Reserve(size_t n) {
+		size_t per_shard = n / kShards + 1;
+		for (size_t s = 0; s < kShards; ++s) {
+			std::lock_guard<SpinLock> lock(shards_[s].lock);
+			while (Capacity(shards_[s]) * 3 < per_shard * 4) Grow(shards_[s]);
+		}
+	}
+
+	//row index of id, kNoRow when it has none
+	uint64_t Find(uint64_t id) const {
+		uint64_t h = util_hash64(id);
+		const Table* t = shards_[h >> (64 - kShardBits)].table.load(std::memory_order_acquire);
+		if (t == NULL) return kNoRow;
+		for (size_t k = h & t->mask; ; k = (k + 1) & t->mask) {
+			uint64_t row = t->slots[k].row.load(std::memory_order_acquire);
+			if (row == kNoRow || t->slots[k].id.load(std::memory_order_relaxed) == id) return row;
+		}
+	}
+
+	//row index of id, taken from make_row() when id is new. make_row runs under the
+	//shard lock, so no other thread sees the row before it returns
+	template<typename MakeRow>
+	uint64_t FindOrInsert(uint64_t id, MakeRow make_row) {
+		uint64_t h = util_hash64(id);
+		Shard& shard = shards_[h >> (64 - kShardBits)];
+		std::lock_guard<SpinLock> lock(shard.lock);
+		if ((shard.size + 1) * 4 > Capacity(shard) * 3) Grow(shard);
+		Slot& e = Probe(*shard.table.load(std::memory_order_relaxed), id, h);
+		uint64_t row = e.row.load(std::memory_order_relaxed);
+		if (row == kNoRow) {
+			row = make_row();
+			e.id.store(id, std::memory_order_relaxed);
+			e.row.store(row, std::memory_order_release);
+			++shard.size;
+			size_.fetch_add(1, std::memory_order_relaxed);
+		}
+		return row;
+	}
+
+	size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+	//(id, row) of every entry ordered by row, which is insertion order
+	void Entries(std::vector<std::pair<uint64_t, uint64_t> >& entries) const {
+		entries.clear();
+		for (size_t s = 0; s < kShards; ++s) {
+			std::lock_guard<SpinLock> lock(shards_[s].lock);
+			const Table* t = shards_[s].table.load(std::memory_order_relaxed);
+			for (size_t k = 0; t != NULL && k <= t->mask; ++k) {
+				uint64_t row = t->slots[k].row.load(std::memory_order_relaxed);
+				if (row != kNoRow) entries.push_back(std::make_pair(t->slots[k].id.load(std::memory_order_relaxed), row));
+			}
+		}
+		std::sort(entries.begin(), entries.end(),
+			[] (const std::pair<uint64_t, uint64_t>& a, const std::pair<uint64_t, uint64_t>& b) {
+				return a.second < b.second;
+			});
+	}
+
+private:
+	struct Slot {
+		std::atomic<uint64_t> id;
+		std::atomic<uint64_t> row;
+		Slot() : id(0), row(kNoRow) {}
+	};
+	struct Table {
+		size_t mask;				//slot count - 1, the count is a power of two
+		std::unique_ptr<Slot[]> slots;
+		explicit Table(size_t n) : mask(n - 1), slots(new Slot[n]) {}
+	};
+	struct Shard {
+		SpinLock lock;
+		std::atomic<const Table*> table;	//the last of tables, NULL before the first insert
+		std::vector<std::unique_ptr<Table> > tables;
+		size_t size;
+		char pad[64];				//keep neighbouring shard locks off one cache line
+		Shard() : table(NULL), size(0) {}
+	};
+
+	static size_t Capacity(const Shard& shard) {
+		return shard.tables.empty() ? 0 : shard.tables.back()->mask + 1;
+	}
+
+	//slot of id, or of the empty slot where it belongs. writers only
+	static Slot& Probe(const Table& t, uint64_t id, uint64_t h) {
+		size_t k = h & t.mask;
+		while (t.slots[k].row.load(std::memory_order_relaxed) != kNoRow
+				&& t.slots[k].id.load(std::memory_order_relaxed) != id)
+			k = (k + 1) & t.mask;
+		return t.slots[k];
+	}
+
+	static void Grow(Shard& shard) {
+		size_t n = std::max<size_t>(16, Capacity(shard) * 2);
+		std::unique_ptr<Table> t(new Table(n));
+		if (!shard.tables.empty()) {
+			const Table& old = *shard.tables.back();
+			for (size_t k = 0; k <= old.mask; ++k) {
+				uint64_t row = old.slots[k].row.load(std::memory_order_relaxed);
+				if (row == kNoRow) continue;
+				uint64_t id = old.slots[k].id.load(std::memory_order_relaxed);
+				Slot& e = Probe(*t, id, util_hash64(id));
+				e.id.store(id, std::memory_order_relaxed);
+				e.row.store(row, std::memory_order_relaxed);
+			}
+		}
+		shard.table.store(t.get(), std::memory_order_release);
+		shard.tables.push_back(std::move(t));
+	}
+
+	std::unique_ptr<Shard[]> shards_;
+	std::atomic<size_t> size_{0};
+};
+
+//rows handed out one by one from chunks that never move, so a row pointer stays valid
+//while the model grows. every row has a spin lock, kept in a chunk next to it. chunks come from an arena when huge pages are enabled, the
+//chunk table covers 2^36 rows, far past any model that fits in memory
+template<typename T>
+class RowChunks {
+public:
+	enum { kChunkBits = 16, kMaxChunks = 1 << 20 };
+
+	RowChunks() : l_dim_(0), chunks_(new std::atomic<T*>[kMaxChunks]),
+			lock_chunks_(new SpinLock*[kMaxChunks]()), next_(0) {
+		for (size_t c = 0; c < kMaxChunks; ++c) chunks_[c] = NULL;
+	}
+	~RowChunks() {
+		for (size_t k = 0; k < heap_.size(); ++k) delete [] heap_[k];
+		for (size_t k = 0; k < arenas_.size(); ++k) delete arenas_[k];
+	}
+
+	void Initialize(int l_dim) { l_dim_ = l_dim; }
+
+	//index of a new uninitialized row
+	uint64_t Allocate() {
+		uint64_t i = next_.fetch_add(1, std::memory_order_relaxed);
+		size_t c = i >> kChunkBits;
+		if (chunks_[c].load(std::memory_order_acquire) == NULL) {
+			std::lock_guard<SpinLock> lock(lock_);
+			if (chunks_[c].load(std::memory_order_relaxed) == NULL) {
+				locks_.emplace_back(new SpinLock[1 << kChunkBits]);
+				lock_chunks_[c] = locks_.back().get();
+				chunks_[c].store(NewChunk(), std::memory_order_release);
+			}
+		}
+		return i;
+	}
+
+	inline T* row(uint64_t i) const {
+		return chunks_[i >> kChunkBits].load(std::memory_order_acquire)
+			+ (i & ((1 << kChunkBits) - 1)) * l_dim_;
+	}
+	//the lock of row i, held while it is read and updated
+	inline SpinLock* lock(uint64_t i) const {
+		chunks_[i >> kChunkBits].load(std::memory_order_acquire);
+		return lock_chunks_[i >> kChunkBits] + (i & ((1 << kChunkBits) - 1));
+	}
+
+private:
+	T* NewChunk() {
+		size_t elems = static_cast<size_t>(l_dim_) << kChunkBits;
+		if (factor_arena_enabled()) {
+			FactorArena* arena = new FactorArena();
+			if (arena->Map(elems * sizeof(T))) {
+				arenas_.push_back(arena);
+				return static_cast<T*>(arena->base());
+			}
+			delete arena;
+		}
+		heap_.push_back(new T[elems]);
+		return heap_.back();
+	}
+
+	int l_dim_;
+	std::unique_ptr<std::atomic<T*>[]> chunks_;
+	std::unique_ptr<SpinLock*[]> lock_chunks_;	//published with chunks_[c]
+	std::vector<std::unique_ptr<SpinLock[]> > locks_;
+	std::atomic<uint64_t> next_;
+	SpinLock lock_;
+	std::vector<T*> heap_;
+	std::vector<FactorArena*> arenas_;
+};
+
+#endif // SRC_ROW_MAP_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
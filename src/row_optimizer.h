@@ -0,0 +1,98 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_ROW_OPTIMIZER_H
+#define SRC_ROW_OPTIMIZER_H
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "src/half.h"
+
+enum OptimizerType { kOptSGD = 0, kOptAdaGrad = 1, kOptAdam = 2 };
+
+inline bool parse_optimizer(const std::string& name, OptimizerType& type) {
+	if (name == "sgd") type = kOptSGD;
+	else if (name == "adagrad") type = kOptAdaGrad;
+	else if (name == "adam") type = kOptAdam;
+	else return false;
+	return true;
+}
+
+//per row adaptive learning rates with compact state: the squared gradient
+//statistic is one float per row (row wise adagrad / adam), adam's first moment
+//is kept per element in fp16. the state is shared by all workers and updated
+//without locks, like the rows themselves
+template<typename T>
+class RowOptimizer {
+public:
+	RowOptimizer() : type_(kOptSGD), l_dim_(0), beta1_(0.9f), beta2_(0.999f), eps_(1e-8f) {}
+
+	void Initialize(OptimizerType type, size_t rows, int l_dim) {
+		type_ = type;
+		l_dim_ = l_dim;
+		if (type_ != kOptSGD) g2_.assign(rows, 0.f);
+		if (type_ == kOptAdam) m_.assign(rows * l_dim, 0);
+	}
+
+	OptimizerType type() const { return type_; }
+
+	//turn the gradient of row into the direction to step along (in place)
+	//and return the learning rate multiplier of the row
+	inline T Rate(size_t row, T* grad) {
+		if (type_ == kOptSGD) return 1;
+
+		float g2 = 0.f;
+		for (int l = 0; l < l_dim_; ++l) g2 += grad[l] * grad[l];
+		g2 /= l_dim_;
+
+		if (type_ == kOptAdaGrad) {
+			float acc = g2_[row] + g2;
+			g2_[row] = acc;
+			return static_cast<T>(1.f / std::sqrt(acc + eps_));
+		}
+
+		uint16_t* m = &m_[row * l_dim_];
+		float v = g2_[row];
+		//the first touch seeds both moments, which stands in for bias correction
+		bool first = v == 0.f;
+		v = first ? g2 : beta2_ * v + (1.f - beta2_) * g2;
+		g2_[row] = v;
+		for (int l = 0; l < l_dim_; ++l) {
+			float ml = first ? grad[l] : beta1_ * half_to_float(m[l]) + (1.f - beta1_) * grad[l];
+			m[l] = float_to_half(ml);
+			grad[l] = static_cast<T>(ml);
+		}
+		return static_cast<T>(1.f / (std::sqrt(v) + eps_));
+	}
+
+private:
+	OptimizerType type_;
+	int l_dim_;
+	float beta1_;
+	float beta2_;
+	float eps_;
+	std::vector<float> g2_;
+	std::vector<uint16_t> m_;
+};
+
+#endif // SRC_ROW_OPTIMIZER_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
@@ -0,0 +1,162 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef SRC_SAMPLE_BATCH_H
+#define SRC_SAMPLE_BATCH_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "src/file_parser.h"
+
+//the ids of a line packed as zigzag varints: the user, the item count, then every
+//item as its difference to the item before it (the first to 0). ids below 2^31 take
+//1-5 bytes, below the 4 of an int for most real id spaces; 64 bit ids take up to 10
+inline void encode_varint(uint64_t v, std::string& out) {
+	while (v >= 0x80) {
+		out.push_back(static_cast<char>(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back(static_cast<char>(v));
+}
+
+inline const char* decode_varint(const char* p, uint64_t& v) {
+	uint64_t b = static_cast<uint8_t>(*p++);
+	v = b & 0x7f;
+	for (int shift = 7; b & 0x80; shift += 7) {
+		b = static_cast<uint8_t>(*p++);
+		v |= (b & 0x7f) << shift;
+	}
+	return p;
+}
+
+inline uint64_t zigzag(int64_t v) {
+	return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+inline int64_t unzigzag(uint64_t v) {
+	return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+inline void encode_sample(const std::vector<mf_id_t>& x, std::string& out) {
+	if (x.empty()) {
+		encode_varint(zigzag(-1), out);
+		encode_varint(0, out);
+		return;
+	}
+	encode_varint(zigzag(x[0]), out);
+	encode_varint(x.size() - 1, out);
+	mf_id_t prev = 0;
+	for (size_t j = 1; j < x.size(); ++j) {
+		//differences wrap in 64 bits, the decoder wraps them back
+		encode_varint(zigzag(static_cast<int64_t>(static_cast<uint64_t>(x[j]) - static_cast<uint64_t>(prev))), out);
+		prev = x[j];
+	}
+}
+
+//decode one line into x, returns the start of the next
+inline const char* decode_sample(const char* p, std::vector<mf_id_t>& x) {
+	uint64_t v, n;
+	p = decode_varint(p, v);
+	x.resize(1);
+	x[0] = unzigzag(v);
+	p = decode_varint(p, n);
+	mf_id_t prev = 0;
+	for (uint64_t j = 0; j < n; ++j) {
+		p = decode_varint(p, v);
+		prev = static_cast<mf_id_t>(static_cast<uint64_t>(prev) + static_cast<uint64_t>(unzigzag(v)));
+		x.push_back(prev);
+	}
+	return p;
+}
+
+//the user of the line starting at p
+inline mf_id_t sample_user(const char* p) {
+	uint64_t v;
+	decode_varint(p, v);
+	return unzigzag(v);
+}
+
+//the end of the line starting at p, without decoding it
+inline const char* skip_sample(const char* p) {
+	uint64_t v, n;
+	p = decode_varint(p, v);
+	p = decode_varint(p, n);
+	for (uint64_t j = 0; j < n; ++j) {
+		while (*p++ & 0x80) {}
+	}
+	return p;
+}
+
+//the lines of a batch, scores as parsed and ids encoded back to back
+template<typename T>
+class MFSampleBatch {
+public:
+	void Add(T score, const std::vector<mf_id_t>& x) {
+		scores_.push_back(score);
+		encode_sample(x, ids_);
+	}
+	//append a line already encoded by encode_sample
+	void AddEncoded(T score, const char* begin, const char* end) {
+		scores_.push_back(score);
+		ids_.append(begin, end);
+	}
+	size_t size() const { return scores_.size(); }
+	bool empty() const { return scores_.empty(); }
+	size_t bytes() const { return ids_.size() + scores_.size() * sizeof(T); }
+	void clear() {
+		scores_.clear();
+		ids_.clear();
+	}
+
+	//reads the lines in order
+	class Reader {
+	public:
+		explicit Reader(const MFSampleBatch& batch) : batch_(batch), line_(0), pos_(batch.ids_.data()) {}
+
+		bool Next(T& score, std::vector<mf_id_t>& x) {
+			if (line_ >= batch_.size()) return false;
+			score = batch_.scores_[line_++];
+			pos_ = decode_sample(pos_, x);
+			return true;
+		}
+		//the encoded bytes of the next line
+		bool NextEncoded(T& score, const char*& begin, const char*& end) {
+			if (line_ >= batch_.size()) return false;
+			score = batch_.scores_[line_++];
+			begin = pos_;
+			end = pos_ = skip_sample(pos_);
+			return true;
+		}
+
+	private:
+		const MFSampleBatch& batch_;
+		size_t line_;
+		const char* pos_;
+	};
+
+private:
+	std::vector<T> scores_;
+	std::string ids_;
+};
+
+#endif // SRC_SAMPLE_BATCH_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
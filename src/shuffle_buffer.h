@@ -0,0 +1,93 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef SRC_SHUFFLE_BUFFER_H
+#define SRC_SHUFFLE_BUFFER_H
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include "src/sample_batch.h"
+
+//bounded streaming shuffle over sample lines. once the reservoir is full every
+//incoming line takes the slot of a uniformly chosen resident, which is emitted,
+//so a line leaves at a random later position while memory stays at capacity lines.
+//residents are kept in their encoded batch form
+template<typename T>
+class ShuffleBuffer {
+public:
+	ShuffleBuffer() : capacity_(0) {}
+
+	void Initialize(size_t capacity, uint64_t seed) {
+		capacity_ = capacity;
+		rand_.seed(seed);
+		scores_.clear();
+		lines_.clear();
+		scores_.reserve(capacity_);
+		lines_.reserve(capacity_);
+	}
+
+	bool enabled() const { return capacity_ > 0; }
+	size_t size() const { return lines_.size(); }
+
+	//feed the lines of in, the lines evicted from the reservoir are appended to out
+	void Push(MFSampleBatch<T>& in, MFSampleBatch<T>& out) {
+		typename MFSampleBatch<T>::Reader reader(in);
+		T score;
+		const char* begin;
+		const char* end;
+		while (reader.NextEncoded(score, begin, end)) {
+			if (lines_.size() < capacity_) {
+				scores_.push_back(score);
+				lines_.push_back(std::string(begin, end));
+				continue;
+			}
+			size_t k = rand_() % capacity_;
+			out.AddEncoded(scores_[k], lines_[k].data(), lines_[k].data() + lines_[k].size());
+			scores_[k] = score;
+			lines_[k].assign(begin, end);
+		}
+		in.clear();
+	}
+
+	//emit up to max_lines residents in random order, for the end of the stream
+	void Drain(MFSampleBatch<T>& out, size_t max_lines) {
+		for (size_t n = 0; n < max_lines && !lines_.empty(); ++n) {
+			size_t k = rand_() % lines_.size();
+			out.AddEncoded(scores_[k], lines_[k].data(), lines_[k].data() + lines_[k].size());
+			scores_[k] = scores_.back();
+			lines_[k].swap(lines_.back());
+			scores_.pop_back();
+			lines_.pop_back();
+		}
+	}
+
+private:
+	size_t capacity_;
+	std::mt19937_64 rand_;
+	std::vector<T> scores_;
+	std::vector<std::string> lines_;
+};
+
+#endif // SRC_SHUFFLE_BUFFER_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
@@ -0,0 +1,73 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_SPSC_QUEUE_H
+#define SRC_SPSC_QUEUE_H
+
+#include <atomic>
+#include <vector>
+
+//lock free ring buffer for exactly one producer thread and one consumer thread
+template<typename E>
+class SpscQueue {
+public:
+	SpscQueue() : mask_(0), head_(0), tail_(0) {}
+
+	void Initialize(size_t capacity) {
+		size_t n = 2;
+		while (n < capacity + 1) n <<= 1;
+		ring_.assign(n, E());
+		mask_ = n - 1;
+		head_.store(0, std::memory_order_relaxed);
+		tail_.store(0, std::memory_order_relaxed);
+	}
+
+	bool Push(const E& e) {
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		size_t next = (tail + 1) & mask_;
+		if (next == head_.load(std::memory_order_acquire)) return false;
+		ring_[tail] = e;
+		tail_.store(next, std::memory_order_release);
+		return true;
+	}
+
+	bool Pop(E& e) {
+		size_t head = head_.load(std::memory_order_relaxed);
+		if (head == tail_.load(std::memory_order_acquire)) return false;
+		e = ring_[head];
+		head_.store((head + 1) & mask_, std::memory_order_release);
+		return true;
+	}
+
+private:
+	enum { kCacheLine = 64 };
+
+	std::vector<E> ring_;
+	size_t mask_;
+	//keep the consumer and producer indices on separate cache lines
+	char pad0_[kCacheLine];
+	std::atomic<size_t> head_;
+	char pad1_[kCacheLine];
+	std::atomic<size_t> tail_;
+	char pad2_[kCacheLine];
+};
+
+#endif // SRC_SPSC_QUEUE_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
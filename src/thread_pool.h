@@ -0,0 +1,171 @@
+// Copyright (c) 2014-2015 The AsyncMF Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef SRC_THREAD_POOL_H
+#define SRC_THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+//numa node of a cpu from sysfs, 0 when unknown
+inline int cpu_numa_node(int cpu) {
+#ifdef __linux__
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR* dir = opendir(path);
+	if (!dir) return 0;
+	int node = 0;
+	while (struct dirent* entry = readdir(dir)) {
+		if (sscanf(entry->d_name, "node%d", &node) == 1) break;
+	}
+	closedir(dir);
+	return node;
+#else
+	return 0;
+#endif
+}
+
+//persistent worker threads, Run(func, n) calls func(i) for i in [0, n) with every
+//call on its own thread, like spawning n threads, and thread i is always the same
+//thread, so memory it touches first stays on its node. with pinning, thread i is
+//bound to one cpu and consecutive threads fill a numa node before the next one
+class ThreadPool {
+public:
+	ThreadPool() : pin_(false), stop_(false), busy_(false), task_num_(0), generation_(0), pending_(0) {}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		start_cv_.notify_all();
+		for (size_t i = 0; i < threads_.size(); ++i) threads_[i].join();
+	}
+
+	//bind pool threads to cpus, threads that already exist are rebound
+	void SetPinning(bool pin) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		pin_ = pin;
+		if (pin_ && cpus_.empty()) {
+			int cpu_num = std::max(1u, std::thread::hardware_concurrency());
+			for (int c = 0; c < cpu_num; ++c) cpus_.push_back(std::make_pair(cpu_numa_node(c), c));
+			std::sort(cpus_.begin(), cpus_.end());
+		}
+		for (size_t i = 0; i < threads_.size(); ++i) Pin(threads_[i], i);
+	}
+
+	//numa node pool thread i runs on when pinned, -1 when not pinned
+	int node(size_t i) const { return pin_ ? cpus_[i % cpus_.size()].first : -1; }
+
+	static bool in_pool_thread() { return pool_thread_flag(); }
+
+	template<class Func>
+	void Run(const Func& func, size_t n) {
+		if (n == 0) return;
+		//nested or concurrent calls cannot wait on the pool, they get their own threads
+		if (in_pool_thread() || busy_.exchange(true)) {
+			std::vector<std::thread> threads;
+			for (size_t i = 0; i < n; ++i) threads.push_back(std::thread(func, i));
+			for (size_t i = 0; i < n; ++i) threads[i].join();
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (threads_.size() < n) {
+			threads_.push_back(std::thread(&ThreadPool::Loop, this, threads_.size()));
+			if (pin_) Pin(threads_.back(), threads_.size() - 1);
+		}
+		task_ = [&func] (size_t i) { func(i); };
+		task_num_ = n;
+		pending_ = n;
+		++generation_;
+		start_cv_.notify_all();
+		done_cv_.wait(lock, [this] { return pending_ == 0; });
+		task_ = nullptr;
+		busy_ = false;
+	}
+
+private:
+	static bool& pool_thread_flag() {
+		static thread_local bool flag = false;
+		return flag;
+	}
+
+	void Pin(std::thread& thread, size_t i) {
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpus_[i % cpus_.size()].second, &set);
+		pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+	}
+
+	void Loop(size_t index) {
+		pool_thread_flag() = true;
+		unsigned long long seen = 0;
+		std::unique_lock<std::mutex> lock(mutex_);
+		for (;;) {
+			start_cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+			if (stop_) return;
+			seen = generation_;
+			if (index >= task_num_) continue;
+			lock.unlock();
+			task_(index);
+			lock.lock();
+			if (--pending_ == 0) done_cv_.notify_one();
+		}
+	}
+
+	bool pin_;
+	bool stop_;
+	std::atomic<bool> busy_;
+	std::vector<std::pair<int, int> > cpus_;	//(node, cpu), sorted
+	std::vector<std::thread> threads_;
+
+	std::mutex mutex_;
+	std::condition_variable start_cv_;
+	std::condition_variable done_cv_;
+	std::function<void(size_t)> task_;
+	size_t task_num_;
+	unsigned long long generation_;
+	size_t pending_;
+};
+
+//the pool behind util_parallel_run, shared by the trainer, the solvers and the tools
+inline ThreadPool& global_thread_pool() {
+	static ThreadPool pool;
+	return pool;
+}
+
+#endif // SRC_THREAD_POOL_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
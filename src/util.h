@@ -22,11 +22,14 @@
 #define SRC_UTIL_H
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <future>
 #include <limits>
 #include <vector>
+#include "src/thread_pool.h"
 
 #define MAX_EXP_NUM 50.
 #define MIN_SIGMOID (10e-15)
@@ -39,16 +42,43 @@ void util_parallel_run(const Func& func, size_t num_threads = 0) {
 		num_threads = std::thread::hardware_concurrency();
 	}
 
-	std::thread *threads = new std::thread[num_threads];
-	for (size_t i = 0; i < num_threads; ++i) {
-		threads[i] = std::thread(func, i);
-	}
+	global_thread_pool().Run(func, num_threads);
+}
 
-	for (size_t i = 0; i < num_threads; ++i) {
-		threads[i].join();
+//run func(row) for rows [0, n) on num_threads threads, handing out chunks dynamically.
+//inside a pool thread the rows run inline, so the memory they touch stays local
+template<class Func>
+void util_parallel_for(size_t n, const Func& func, size_t num_threads) {
+	if (ThreadPool::in_pool_thread()) {
+		for (size_t r = 0; r < n; ++r) func(r);
+		return;
 	}
+	enum { kChunk = 256 };
+	std::atomic<size_t> next(0);
+	auto worker_func = [&] (size_t) {
+		for (;;) {
+			size_t begin = next.fetch_add(kChunk);
+			if (begin >= n) break;
+			size_t end = std::min(n, begin + static_cast<size_t>(kChunk));
+			for (size_t r = begin; r < end; ++r) func(r);
+		}
+	};
+	util_parallel_run(worker_func, num_threads);
+}
 
-	delete [] threads;
+//like util_parallel_for, but row r always runs on pool thread r % num_threads,
+//so the rows a thread later owns are first touched on its numa node
+template<class Func>
+void util_parallel_for_static(size_t n, const Func& func, size_t num_threads) {
+	if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+	if (ThreadPool::in_pool_thread()) {
+		for (size_t r = 0; r < n; ++r) func(r);
+		return;
+	}
+	auto worker_func = [&] (size_t t) {
+		for (size_t r = t; r < n; r += num_threads) func(r);
+	};
+	util_parallel_run(worker_func, num_threads);
 }
 
 template<typename T>
@@ -109,10 +139,43 @@ inline T safe_exp(T x) {
 	return std::exp(std::max(std::min(x, max_exp), -max_exp));
 }
 
+//splitmix64 finalizer, a cheap well mixed hash of a 64 bit key
+inline uint64_t util_hash64(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+#define SIGMOID_TABLE_SIZE 8192
+#define SIGMOID_TABLE_RANGE 16.
+
+//sigmoid sampled on [-SIGMOID_TABLE_RANGE, SIGMOID_TABLE_RANGE], built once per process
+inline const float* sigmoid_table() {
+	static const std::vector<float> table = [] {
+		std::vector<float> t(SIGMOID_TABLE_SIZE + 1);
+		for (int i = 0; i <= SIGMOID_TABLE_SIZE; ++i) {
+			double x = (2. * i / SIGMOID_TABLE_SIZE - 1.) * SIGMOID_TABLE_RANGE;
+			t[i] = static_cast<float>(1. / (1. + std::exp(-x)));
+		}
+		return t;
+	}();
+	return &table[0];
+}
+
+//table lookup with linear interpolation instead of std::exp, saturates outside the table
 template<typename T>
 inline T sigmoid(T x) {
-	T one = 1.;
-	return one / (one + safe_exp(-x));
+	static const float* table = sigmoid_table();
+	const T range = static_cast<T>(SIGMOID_TABLE_RANGE);
+	if (!(x > -range)) return static_cast<T>(MIN_SIGMOID);
+	if (!(x < range)) return static_cast<T>(MAX_SIGMOID);
+	T pos = (x + range) * static_cast<T>(SIGMOID_TABLE_SIZE / (2. * SIGMOID_TABLE_RANGE));
+	int i = static_cast<int>(pos);
+	T frac = pos - i;
+	return table[i] + frac * (table[i + 1] - table[i]);
 }
 
 #endif // SRC_UTIL_H